@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _CLUTCH_STATS_H
+#define _CLUTCH_STATS_H
+
+/*
+ * clutch 调度器统计项下标
+ *
+ * BPF 侧按下标累加 percpu 计数，用户态 loader 汇总所有 CPU 后输出。
+ */
+enum clutch_stat_idx {
+    CLUTCH_STAT_SE_POOL_HIT,     /* 从 percpu 对象池取到 clutch_se */
+    CLUTCH_STAT_SE_POOL_MISS,    /* 对象池为空，回退到 bpf_obj_new */
+    CLUTCH_STAT_SE_POOL_REFILL,  /* 批量补充进对象池的节点数 */
+    CLUTCH_STAT_SE_POOL_RECYCLE, /* dispatch 后回收进对象池的节点数 */
+    CLUTCH_STAT_SE_POOL_DROP,    /* 对象池已满，直接释放的节点数 */
+    CLUTCH_STAT_DISPATCH_NS,     /* dispatch_bench: 取任务引用到 dispatch 完成的累计耗时 */
+    CLUTCH_STAT_DISPATCH_SAMPLES,/* dispatch_bench: 上述耗时的采样次数 */
+    CLUTCH_STAT_DISPATCH_BATCHED,/* 一次回调派发多于一个线程时，这些回调派发的线程总数 */
+    CLUTCH_STAT_SELECT_CPU,      /* select_cpu 调用次数 */
+    CLUTCH_STAT_IDLE_DIRECT,     /* 唤醒到空闲 CPU 且 cluster 无排队工作，直接派发到本地 DSQ */
+    CLUTCH_STAT_KICK_IDLE,       /* 入队后唤醒目标 cluster 内空闲 CPU 的次数 */
+    CLUTCH_STAT_STEAL,           /* 本 cluster 无事可做时从其它 cluster 窃取成功的次数 */
+    CLUTCH_STAT_STEAL_HOT,       /* 候选线程缓存仍热（未超过迁移代价阈值），放弃窃取 */
+    CLUTCH_STAT_STEAL_AFFINITY,  /* 候选线程的 cpumask 不含本 CPU，放弃窃取 */
+    CLUTCH_STAT_GROUP_CREATE,    /* 新建 group_ctx 的次数 */
+    CLUTCH_STAT_GROUP_EVICT,     /* 删除空组的次数；与 GROUP_CREATE 之差即当前组数 */
+    CLUTCH_STAT_GROUP_FULL,      /* group_ctx_map 已满、入队回退到全局 DSQ 的次数 */
+    CLUTCH_STAT_DEQUEUE,         /* ops.dequeue 使排队节点失效的次数 */
+    CLUTCH_STAT_DEQUEUE_EAGER,   /* 失效节点恰好是组内队头、被立即删除的次数 */
+    CLUTCH_STAT_DEQUEUE_STALE,   /* dispatch 取到已失效节点并丢弃的次数 */
+    CLUTCH_STAT_BOUND_ENQUEUE,   /* 绑核任务进入 per-CPU 绑定队列的次数 */
+    CLUTCH_STAT_BOUND_DISPATCH,  /* dispatch 从本 CPU 绑定队列取到任务的次数 */
+    CLUTCH_STAT_PREEMPT_KICK,    /* 入队时用 SCX_KICK_PREEMPT 抢占运行低优先级 bucket 的 CPU */
+    CLUTCH_STAT_TICK_PREEMPT_BUCKET,   /* tick 发现更早 deadline 的 bucket 在等待，清零 slice */
+    CLUTCH_STAT_TICK_PREEMPT_VRUNTIME, /* tick 发现同 bucket 内落后的组在等待，清零 slice */
+    CLUTCH_STAT_QOS_CLASSIFY,    /* thread_ctx 中的分类缓存失效、重新计算 bucket 的次数 */
+    CLUTCH_STAT_FORK_PLACE,      /* fork 出的新任务被放到负载最轻的 cluster 的次数 */
+    CLUTCH_NR_STATS,
+};
+
+/* 时间片直方图档数：<1ms、1-2ms、2-4ms、4-8ms、>=8ms。 */
+#define CLUTCH_SLICE_HIST_BINS 5
+
+/* qos_tgid_map / qos_cgroup_map 各自的容量，也是 loader 接受的覆盖条数上限。 */
+#define CLUTCH_MAX_QOS_OVERRIDES 1024
+
+/*
+ * 按 bucket 编号汇总的统计（percpu，所有 cluster 共用同一组槽位）
+ */
+struct clutch_bucket_stats {
+    __u64 selected;      /* bucket 被 EDF 选中并派发的次数 */
+    __u64 deadline_miss; /* 选中时已经超过绝对 deadline 的次数 */
+    __u64 miss_ns;       /* 上述超时的累计迟到时间 */
+    __u64 warp;          /* 靠 warp 越过 EDF 顺序被选中的次数 */
+    __u64 warp_exhausted;/* warp 窗口到期、预算被清零的次数 */
+    __u64 slices;        /* 该 bucket 的线程带着时间片被派发（或插入 DSQ）的次数 */
+    __u64 slice_ns;      /* 上述时间片的累计长度 */
+    __u64 slice_hist[CLUTCH_SLICE_HIST_BINS]; /* 按 CLUTCH_SLICE_HIST_BINS 分档的时间片分布 */
+};
+
+#endif /* _CLUTCH_STATS_H */
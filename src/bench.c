@@ -0,0 +1,258 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+
+typedef uint8_t  u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define CLUTCH_CACHELINE_SIZE 64
+#define CORES_PER_CLUSTER     5
+#define MAX_BENCH_THREADS     64
+#define DEFAULT_BENCH_THREADS 4
+#define DEFAULT_BENCH_ITERS   5000000
+
+/* 与 BPF 侧 clutch_avg 一致的布局。 */
+struct bench_avg {
+    u64 base;
+    int64_t vsum;
+    u64 load;
+    u64 cur;
+};
+
+/* 与 BPF 侧 bucket_ctx（不含末尾补齐）一致的字段布局：
+ * bpf_spin_lock 为 4 字节，bpf_rb_root 以两个 u64 占位。
+ */
+struct bench_bucket {
+    u32 lock;
+    u64 group_cfs_rq[2];
+    u64 group_eligible_rq[2];
+    u32 nr_groups;
+    struct bench_avg avg;
+};
+
+/* clutch.bpf.c 当前使用的布局：热区之后补一整条 cache line。 */
+struct bench_bucket_padded {
+    struct bench_bucket hot;
+    u8 __pad[CLUTCH_CACHELINE_SIZE];
+};
+
+struct bench_config {
+    const char *mode;
+    u32 nr_threads;
+    u64 iters;
+};
+
+struct bench_worker {
+    pthread_t thread;
+    pthread_barrier_t *barrier;
+    struct bench_bucket *bucket;
+    int cpu;
+    u64 iters;
+    u64 elapsed_ns;
+};
+
+static u64 now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ULL + (u64)ts.tv_nsec;
+}
+
+static void bench_lock(u32 *lock)
+{
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+            ;
+    }
+}
+
+static void bench_unlock(u32 *lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+/* 每个线程模拟一个 cluster 上的 enqueue/dispatch：只操作自己那个 bucket，
+ * 因此任何额外开销都来自相邻元素共享 cache line。
+ */
+static void *bench_worker_fn(void *arg)
+{
+    struct bench_worker *w = arg;
+    struct bench_bucket *b = w->bucket;
+    cpu_set_t set;
+    u64 i, start;
+
+    if (w->cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    pthread_barrier_wait(w->barrier);
+    start = now_ns();
+
+    for (i = 0; i < w->iters; i++) {
+        bench_lock(&b->lock);
+        b->group_cfs_rq[i & 1] ^= i;
+        b->nr_groups++;
+        b->avg.vsum += (int64_t)(i & 0xff);
+        b->avg.load++;
+        b->avg.cur = b->avg.base + b->avg.load;
+        bench_unlock(&b->lock);
+    }
+
+    w->elapsed_ns = now_ns() - start;
+    return NULL;
+}
+
+/* 以给定步长连续排布 nr_threads 个 bucket，并让每个线程跑在不同 cluster 的 CPU 上。
+ * 返回所有线程的平均单次操作耗时（ns）。
+ */
+static double run_false_sharing(const struct bench_config *cfg, size_t stride)
+{
+    struct bench_worker workers[MAX_BENCH_THREADS];
+    pthread_barrier_t barrier;
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    u64 total_ns = 0;
+    u8 *base;
+    u32 i;
+
+    base = aligned_alloc(CLUTCH_CACHELINE_SIZE,
+                         (stride * cfg->nr_threads + CLUTCH_CACHELINE_SIZE - 1) /
+                         CLUTCH_CACHELINE_SIZE * CLUTCH_CACHELINE_SIZE);
+    if (!base)
+        return -1;
+    memset(base, 0, stride * cfg->nr_threads);
+
+    pthread_barrier_init(&barrier, NULL, cfg->nr_threads);
+
+    for (i = 0; i < cfg->nr_threads; i++) {
+        workers[i] = (struct bench_worker){
+            .barrier = &barrier,
+            .bucket = (struct bench_bucket *)(base + stride * i),
+            .cpu = nr_cpus > 0 ? (int)((i * CORES_PER_CLUSTER) % nr_cpus) : -1,
+            .iters = cfg->iters,
+        };
+        pthread_create(&workers[i].thread, NULL, bench_worker_fn, &workers[i]);
+    }
+
+    for (i = 0; i < cfg->nr_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total_ns += workers[i].elapsed_ns;
+    }
+
+    pthread_barrier_destroy(&barrier);
+    free(base);
+
+    return (double)total_ns / ((double)cfg->iters * cfg->nr_threads);
+}
+
+static int bench_false_sharing(const struct bench_config *cfg)
+{
+    double packed, padded;
+
+    printf("false-sharing benchmark: %u threads (one per cluster) x %llu iters\n",
+           cfg->nr_threads, (unsigned long long)cfg->iters);
+
+    packed = run_false_sharing(cfg, sizeof(struct bench_bucket));
+    padded = run_false_sharing(cfg, sizeof(struct bench_bucket_padded));
+    if (packed < 0 || padded < 0) {
+        fprintf(stderr, "Failed to allocate bucket array\n");
+        return 1;
+    }
+
+    printf("  - packed layout (%zuB stride): %.2f ns/op\n",
+           sizeof(struct bench_bucket), packed);
+    printf("  - padded layout (%zuB stride): %.2f ns/op\n",
+           sizeof(struct bench_bucket_padded), padded);
+    printf("  - false-sharing cost: %.2fx\n", padded > 0 ? packed / padded : 0.0);
+    return 0;
+}
+
+static int parse_u64_arg(const char *arg, u64 *value)
+{
+    char *end = NULL;
+    unsigned long long parsed;
+
+    errno = 0;
+    parsed = strtoull(arg, &end, 10);
+    if (errno || !end || *end != '\0' || !parsed)
+        return -EINVAL;
+
+    *value = (u64)parsed;
+    return 0;
+}
+
+static int parse_bench_config(int argc, char **argv, struct bench_config *cfg)
+{
+    u64 value;
+    int i;
+
+    *cfg = (struct bench_config){
+        .mode = "false-sharing",
+        .nr_threads = DEFAULT_BENCH_THREADS,
+        .iters = DEFAULT_BENCH_ITERS,
+    };
+
+    for (i = 1; i < argc; i++) {
+        if (!strncmp(argv[i], "--mode=", 7)) {
+            cfg->mode = argv[i] + 7;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "--threads=", 10)) {
+            if (parse_u64_arg(argv[i] + 10, &value) || value > MAX_BENCH_THREADS)
+                return -EINVAL;
+            cfg->nr_threads = (u32)value;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "--iters=", 8)) {
+            if (parse_u64_arg(argv[i] + 8, &cfg->iters))
+                return -EINVAL;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--help")) {
+            printf("Usage: %s [--mode=false-sharing] [--threads=N] [--iters=N]\n", argv[0]);
+            printf("  --mode      benchmark to run (false-sharing)\n");
+            printf("  --threads   concurrent clusters to simulate (1-%d)\n", MAX_BENCH_THREADS);
+            printf("  --iters     lock/update iterations per thread\n");
+            return 1;
+        }
+
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_config cfg;
+    int err;
+
+    err = parse_bench_config(argc, argv, &cfg);
+    if (err) {
+        if (err > 0)
+            return 0;
+
+        fprintf(stderr, "Invalid benchmark arguments\n");
+        return 1;
+    }
+
+    if (!strcmp(cfg.mode, "false-sharing"))
+        return bench_false_sharing(&cfg);
+
+    fprintf(stderr, "Unknown benchmark mode: %s\n", cfg.mode);
+    return 1;
+}
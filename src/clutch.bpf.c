@@ -2,9 +2,13 @@
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_tracing.h>
 #include <bpf/bpf_experimental.h>
+#include "clutch_stats.h"
 
 #define NICE_0_LOAD              1024ULL
 #define DEFAULT_SLICE_NS         3000000ULL
+#define CLUTCH_SLICE_MIN_NS      500000ULL
+#define CLUTCH_SLICE_MAX_NS      20000000ULL
+#define CLUTCH_SLICE_HIST_BASE_NS 1000000ULL
 #define MAX_RT_PRIO              100
 #define MAX_CPUS                 256
 #define MAX_CLUSTERS             MAX_CPUS
@@ -12,7 +16,50 @@
 #define MAX_CLUTCH_BUCKETS       8
 #define DEFAULT_CPUS_PER_CLUSTER 4
 #define DEFAULT_CLUTCH_BUCKETS   5
-#define CPU_RUN_STATE_KEY        0
+#define CLUTCH_MAX_CLUSTER_CPUS  64
+#define CLUTCH_SE_POOL_SIZE      64
+#define CLUTCH_SE_POOL_REFILL    16
+#define CLUTCH_DISPATCH_RETRIES  4
+#define CLUTCH_DISPATCH_STALE_MAX 32
+#define CLUTCH_MAX_DISPATCH_BATCH 64
+#define CLUTCH_CACHELINE_SIZE    64
+#define CLUTCH_TASK_LOOKUP_KPTR  0
+#define CLUTCH_TASK_LOOKUP_PID   1
+#define CLUTCH_ENGINE_RBTREE     0
+#define CLUTCH_ENGINE_DSQ        1
+#define CLUTCH_BUCKET_DSQ_BASE   0x1000ULL
+#define CLUTCH_BOUND_DSQ_BASE    0x2000ULL
+#define CLUTCH_STEAL_IMBALANCE   2
+#define CLUTCH_GROUP_BY_PID      0
+#define CLUTCH_GROUP_BY_TGID     1
+#define CLUTCH_GROUP_BY_CGROUP   2
+#define CLUTCH_GROUP_IDLE_NS     5000000000ULL
+#define CLUTCH_GROUP_REAP_INTERVAL_NS 1000000000ULL
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC          1
+#endif
+#define CLUTCH_STEAL_MIGRATION_COST_NS 500000ULL
+#define CLUTCH_TICK_GRAN_NS         1000000ULL
+#define CLUTCH_INTERACTIVE_PRI   8
+#define CLUTCH_USAGE_HALFLIFE_NS 250000000ULL
+#define CLUTCH_USAGE_MAX_NS      10000000000ULL
+#define CLUTCH_TS_USAGE_PRI      32
+#define CLUTCH_TS_USAGE_UNIT_NS  10000000ULL
+#define CLUTCH_TS_MAX_PRI        (CLUTCH_TS_USAGE_PRI + 2 * CLUTCH_INTERACTIVE_PRI)
+#define CLUTCH_TS_PRI_NS         125000ULL
+#define CLUTCH_EEVDF_MIGRATE_MAX 4
+#define CLUTCH_BUCKET_FG         0
+#define CLUTCH_BUCKET_IN         1
+#define CLUTCH_BUCKET_DF         2
+#define CLUTCH_BUCKET_UT         3
+#define CLUTCH_BUCKET_BG         4
+#define DEFAULT_PRIO             120
+#ifndef SCHED_BATCH
+#define SCHED_BATCH              3
+#endif
+#ifndef SCHED_IDLE
+#define SCHED_IDLE               5
+#endif
 #include "../../tools/sched_ext/include/scx/common.bpf.h"
 
 static const int clutch_prio_to_weight[40] = {
@@ -34,6 +81,7 @@ static const u32 clutch_prio_to_wmult[40] = {
 };
 
 extern struct task_struct *bpf_task_from_pid(s32 pid) __ksym;
+extern struct task_struct *bpf_task_acquire(struct task_struct *p) __ksym;
 extern void bpf_task_release(struct task_struct *p) __ksym;
 
 char _license[] SEC("license") = "GPL";
@@ -43,18 +91,53 @@ const volatile u32 cpus_per_cluster = DEFAULT_CPUS_PER_CLUSTER;
 const volatile u32 nr_clutch_buckets = DEFAULT_CLUTCH_BUCKETS;
 const volatile u32 cpu_cluster_map[MAX_CPUS];
 const volatile u32 cpu_cluster_map_ready;
-const volatile u64 clutch_bucket_ddl_ns[MAX_CLUTCH_BUCKETS];
-
-static const u64 clutch_default_bucket_ddl_ns[MAX_CLUTCH_BUCKETS] = {
+/* 每个 bucket 的相对 deadline（WCEL），默认值与 XNU sched_clutch_root_bucket_wcel 一致；
+ * 默认启用范围之外的 bucket 与 BG 相同。0 是合法配置，表示 deadline 就是 bucket 变为可运行的时刻。
+ */
+const volatile u64 clutch_bucket_ddl_ns[MAX_CLUTCH_BUCKETS] = {
     0ULL,        /* FG */
     37500000ULL, /* IN: 37.5ms */
     75000000ULL, /* DF: 75ms */
     150000000ULL,/* UT: 150ms */
     250000000ULL,/* BG: 250ms */
+    250000000ULL,
+    250000000ULL,
+    250000000ULL,
+};
+/* 每个 bucket 的 warp 预算，默认值与 XNU sched_clutch_root_bucket_warp 一致。 */
+const volatile u64 clutch_bucket_warp_ns[MAX_CLUTCH_BUCKETS] = {
+    8000000ULL,  /* FG: 8ms */
+    4000000ULL,  /* IN: 4ms */
+    2000000ULL,  /* DF: 2ms */
+    1000000ULL,  /* UT: 1ms */
+    0ULL,        /* BG */
+};
+/* 每个 bucket 的基准时间片：前台短、后台长，cluster 过载时再按比例缩短。 */
+const volatile u64 clutch_bucket_slice_ns[MAX_CLUTCH_BUCKETS] = {
+    2000000ULL,  /* FG: 2ms */
+    3000000ULL,  /* IN: 3ms */
+    4000000ULL,  /* DF: 4ms */
+    8000000ULL,  /* UT: 8ms */
+    12000000ULL, /* BG: 12ms */
 };
+const volatile u64 clutch_slice_min_ns = CLUTCH_SLICE_MIN_NS;
+const volatile u64 clutch_slice_max_ns = CLUTCH_SLICE_MAX_NS;
+const volatile u32 dispatch_task_lookup = CLUTCH_TASK_LOOKUP_KPTR;
+const volatile bool dispatch_bench;
+const volatile u32 dispatch_batch = 1;
+const volatile u32 clutch_engine = CLUTCH_ENGINE_RBTREE;
+const volatile u32 steal_imbalance = CLUTCH_STEAL_IMBALANCE;
+const volatile u64 steal_migration_cost_ns = CLUTCH_STEAL_MIGRATION_COST_NS;
+const volatile u32 clutch_group_by = CLUTCH_GROUP_BY_TGID;
+const volatile bool preempt_disabled;
+const volatile bool clutch_eevdf;
+
+/* 由 ops.init 根据 CPU -> cluster 映射统计出的 cluster 数。 */
+u32 clutch_nr_clusters = 1;
 
 struct clutch_se {
     struct bpf_rb_node rb_node;
+    struct task_struct __kptr *task;
     s32 pid;
     s32 tgid;
     s32 dispatch_cpu;
@@ -62,50 +145,126 @@ struct clutch_se {
     u32 bucket_id;
     u32 nr_children;
     u64 vruntime;
+    u64 deadline;
     u64 wmult;
     u64 slice_ns;
+    u64 stop_ns;
     u64 seq;
+    bool eligible;
 };
 
+/* 队列中实体的加权平均 vruntime：以 base 为基准累加 (v - base) * w，
+ * avg = base + vsum / load。嵌在 group_ctx / bucket_ctx 中，由所在结构的锁保护；
+ * cur 缓存最近一次算出的平均值，供不持锁的放置路径读取，队列为空时保留最后的值。
+ */
+struct clutch_avg {
+    u64 base;
+    s64 vsum;
+    u64 load;
+    u64 cur;
+};
+
+/* 组状态，存放在 BPF_F_NO_PREALLOC 的 hash map 中：每个元素单独分配，
+ * 相邻元素之间没有固定布局，末尾补齐无法隔离 cache line，因此不补。
+ */
 struct group_ctx {
     struct bpf_rb_root thread_cfs_rq __contains(clutch_se, rb_node);
+    struct bpf_rb_root thread_eligible_rq __contains(clutch_se, rb_node);
     struct bpf_spin_lock lock;
-    s32 pid;
+    u32 group_id;
     s32 dispatch_cpu;
     u32 cluster_id;
     u32 bucket_id;
     u32 nr_children;
+    u32 queued;
+    u32 dead;
+    u32 interactivity;
+    u32 ts_pri;
     u64 vruntime;
     u64 seq;
+    u64 last_active_ns;
+    u64 cpu_used_ns;
+    u64 cpu_blocked_ns;
+    u64 usage_update_ns;
+    u64 head_vslice;
+    s64 vlag;
+    bool lag_valid;
+    struct clutch_avg avg;
 };
 
+/* bucket_ctx / cluster_ctx 是 array map 中连续排布、被多个 CPU 并发修改的 value，
+ * 几乎所有字段都在入队、派发路径上读写。map 的 value 区并不保证按 cache line 对齐，
+ * 因此不用 aligned 属性，而是在末尾补一整条 cache line：无论起始地址如何，
+ * 相邻元素的字段之间都至少隔着 64 字节，不同 bucket、不同 cluster 的锁与计数不会落在同一行。
+ */
 struct bucket_ctx {
     struct bpf_spin_lock lock;
     struct bpf_rb_root group_cfs_rq __contains(clutch_se, rb_node);
+    struct bpf_rb_root group_eligible_rq __contains(clutch_se, rb_node);
     u32 nr_groups;
+    struct clutch_avg avg;
+    u8 __pad[CLUTCH_CACHELINE_SIZE];
 };
 
 struct cluster_ctx {
-    struct bpf_spin_lock lock;
-    u32 next_bucket;
+    u64 bucket_mask;
+    u64 nr_queued;
+    u64 bucket_deadline_ns[MAX_CLUTCH_BUCKETS];
+    u64 warp_remaining_ns[MAX_CLUTCH_BUCKETS];
+    u64 warp_deadline_ns[MAX_CLUTCH_BUCKETS];
+    struct bpf_cpumask __kptr *cpumask;
+    u8 __pad[CLUTCH_CACHELINE_SIZE];
 };
 
+/* 组按 (cluster, bucket, group_id) 区分：同一进程/cgroup 落在不同 bucket 的线程
+ * 各自成组，组实体始终只属于一棵 bucket 树。
+ */
 struct group_key {
     u32 cluster_id;
+    u32 bucket_id;
     u32 group_id;
 };
 
 struct thread_ctx {
     u64 vruntime;
     u64 last_run_ns;
+    u64 last_stop_ns;
     u64 wmult;
+    u64 group_charge;
+    u64 run_delta_v;
+    u64 run_start_ns;
+    u64 enq_seq;
+    u64 queued_seq;
+    u64 qos_cgroup_id;
+    s64 vlag;
+    u32 qos_prio_key;
+    u32 qos_bucket;
+    struct group_key group;
     u32 cluster_id;
     u32 bucket_id;
     s32 preferred_cpu;
     s32 run_cpu;
     bool is_running;
+    bool group_charged;
+    bool group_valid;
+    bool queued;
+    bool sleeping;
+    bool lag_valid;
+};
+
+/* percpu 对象池中的一个槽位，用 kptr 暂存一个空闲的 clutch_se。 */
+struct clutch_se_stash {
+    struct clutch_se __kptr *node;
 };
 
+/* percpu 对象池状态：槽位 [0, nr_free) 中暂存着可直接复用的节点。 */
+struct clutch_se_pool {
+    u32 nr_free;
+};
+
+/* 每个 CPU 当前运行任务的快照，由该 CPU 的 running/stopping 写入，
+ * 入队路径跨 CPU 读取以寻找可抢占的目标。末尾补齐一条 cache line 的理由同上。
+ */
 struct cpu_run_state {
     u64 wmult;
     u32 cluster_id;
@@ -114,6 +273,14 @@ struct cpu_run_state {
     s32 tgid;
     s32 run_cpu;
     u32 valid;
+    u32 preempt_pending;
+    u8 __pad[CLUTCH_CACHELINE_SIZE];
+};
+
+/* ops.init 预先算好的 cluster 内 CPU 列表，抢占扫描只遍历本 cluster 的 CPU。 */
+struct cluster_cpus {
+    u32 nr;
+    u16 cpus[CLUTCH_MAX_CLUSTER_CPUS];
 };
 
 struct {
@@ -130,11 +297,15 @@ struct {
     __type(value, struct bucket_ctx);
 } bucket_ctx_map SEC(".maps");
 
+/* 空闲组会被删除；不预分配使被删除的元素在 RCU 宽限期内不会被复用，
+ * 仍持有旧指针的路径能在锁内看到 dead 标记，而不是另一个组的数据。
+ */
 struct {
     __uint(type, BPF_MAP_TYPE_HASH);
     __uint(max_entries, MAX_GROUPS);
     __type(key, struct group_key);
     __type(value, struct group_ctx);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
 } group_ctx_map SEC(".maps");
 
 struct {
@@ -146,12 +317,94 @@ struct {
 } thread_ctx_map SEC(".maps");
 
 struct {
-    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
-    __uint(max_entries, 1);
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, MAX_CPUS);
     __type(key, u32);
     __type(value, struct cpu_run_state);
 } cpu_run_state_map SEC(".maps");
 
+/* 按 tgid / cgroup id 指定 bucket 的覆盖表，由用户态写入。 */
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, CLUTCH_MAX_QOS_OVERRIDES);
+    __type(key, u32);
+    __type(value, u32);
+} qos_tgid_map SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, CLUTCH_MAX_QOS_OVERRIDES);
+    __type(key, u64);
+    __type(value, u32);
+} qos_cgroup_map SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, MAX_CLUSTERS);
+    __type(key, u32);
+    __type(value, struct cluster_cpus);
+} cluster_cpus_map SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, u32);
+    __type(value, struct clutch_se_pool);
+} clutch_se_pool_map SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, CLUTCH_SE_POOL_SIZE);
+    __type(key, u32);
+    __type(value, struct clutch_se_stash);
+} clutch_se_stash_map SEC(".maps");
+
+struct clutch_timer {
+    struct bpf_timer timer;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, u32);
+    __type(value, struct clutch_timer);
+} clutch_reaper_timer SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, CLUTCH_NR_STATS);
+    __type(key, u32);
+    __type(value, u64);
+} clutch_stats_map SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, MAX_CLUTCH_BUCKETS);
+    __type(key, u32);
+    __type(value, struct clutch_bucket_stats);
+} clutch_bucket_stats_map SEC(".maps");
+
+/* 累加当前 CPU 上的某个统计项，用户态负责跨 CPU 汇总。 */
+static __always_inline void clutch_stat_add(u32 idx, u64 val)
+{
+    u64 *cnt;
+
+    cnt = bpf_map_lookup_elem(&clutch_stats_map, &idx);
+    if (cnt)
+        *cnt += val;
+}
+
+static __always_inline void clutch_stat_inc(u32 idx)
+{
+    clutch_stat_add(idx, 1);
+}
+
+/* 取当前 CPU 上某个 bucket 的统计槽位。 */
+static __always_inline struct clutch_bucket_stats *clutch_bucket_stats(u32 bucket_id)
+{
+    return bpf_map_lookup_elem(&clutch_bucket_stats_map, &bucket_id);
+}
+
 /* 比较两个组节点在红黑树中的先后顺序，优先按 vruntime，之后再用 pid、
  * cluster_id 和 seq 打破平局，保证树中顺序稳定且可重复。
  */
@@ -184,6 +437,23 @@ static bool clutch_thread_less(struct bpf_rb_node *a, const struct bpf_rb_node *
     return na->tgid < nb->tgid;
 }
 
+/* EEVDF 可选队列的排序：虚拟 deadline 更早者优先，再按 vruntime、pid、seq 打破平局。
+ * 线程与组实体共用这一比较函数。
+ */
+static bool clutch_deadline_less(struct bpf_rb_node *a, const struct bpf_rb_node *b)
+{
+    struct clutch_se *na = container_of(a, struct clutch_se, rb_node);
+    struct clutch_se *nb = container_of(b, struct clutch_se, rb_node);
+
+    if (na->deadline != nb->deadline)
+        return na->deadline < nb->deadline;
+    if (na->vruntime != nb->vruntime)
+        return na->vruntime < nb->vruntime;
+    if (na->pid != nb->pid)
+        return na->pid < nb->pid;
+    return na->seq < nb->seq;
+}
+
 /* 返回当前调度器认为可用的 CPU 数量，并把结果限制在 MAX_CPUS 范围内。 */
 static __always_inline u32 clutch_nr_cpus(void)
 {
@@ -226,21 +496,18 @@ static __always_inline u32 clutch_nr_buckets(void)
     return nr;
 }
 
-/* 读取指定 bucket 的 deadline 配置；未配置时按 XNU clutch root bucket WCEL 默认值回退。 */
+/* 读取指定 bucket 的相对 deadline（WCEL）。
+ * 0 按原值返回：FG 的绝对 deadline 就是它变为可运行或被选中的时刻，总是排在其它 bucket 前面。
+ * 超出启用范围的 bucket 按最后一个启用的 bucket 处理。
+ */
 static __always_inline u64 clutch_bucket_deadline_ns(u32 bucket_id)
 {
-    u64 ddl;
-
-    if (bucket_id >= clutch_nr_buckets())
-        bucket_id = 0;
+    u32 nr = clutch_nr_buckets();
 
-    ddl = clutch_bucket_ddl_ns[bucket_id];
-    if (!ddl && bucket_id < DEFAULT_CLUTCH_BUCKETS)
-        ddl = clutch_default_bucket_ddl_ns[bucket_id];
-    if (!ddl)
-        ddl = clutch_default_bucket_ddl_ns[DEFAULT_CLUTCH_BUCKETS - 1];
+    if (bucket_id >= nr)
+        bucket_id = nr - 1;
 
-    return ddl;
+    return clutch_bucket_ddl_ns[bucket_id & (MAX_CLUTCH_BUCKETS - 1)];
 }
 
 /* 把 CPU 编号映射到 cluster 编号。
@@ -312,13 +579,7 @@ static __always_inline s32 clutch_pick_dispatch_cpu(struct task_struct *p,
     return -1;
 }
 
-/* 先保留简单映射：按 pid 把线程散列到当前活跃 bucket。 */
-static __always_inline u32 clutch_bucket_id(s32 pid)
-{
-    return ((u32)pid) % clutch_nr_buckets();
-}
-
-/* 获取指定 cluster 的上下文对象，用于记录轮转到哪个 bucket。 */
+/* 获取指定 cluster 的上下文对象，其中保存非空 bucket 位图与缓存的 EDF 选桶结果。 */
 static __always_inline struct cluster_ctx *clutch_cluster_ctx(u32 cluster_id)
 {
     if (cluster_id >= MAX_CLUSTERS)
@@ -339,453 +600,2207 @@ static __always_inline struct bucket_ctx *clutch_bucket_ctx(u32 cluster_id, u32
     return bpf_map_lookup_elem(&bucket_ctx_map, &idx);
 }
 
-/* 按 group_key 查找组状态。
- * 如果该组还不存在，就在 map 中创建一个空的 group_ctx。
+/* 返回非零位图中最低置位的下标。bucket 数不超过 MAX_CLUTCH_BUCKETS，
+ * 这里用二分代替 ctz，避免依赖 BPF 后端对位扫描指令的展开。
  */
-static __always_inline struct group_ctx *clutch_group_ctx(struct group_key *key)
+static __always_inline u32 clutch_ffs(u32 mask)
 {
-    struct group_ctx empty = {};
-    struct group_ctx *slot;
+    u32 n = 0;
 
-    slot = bpf_map_lookup_elem(&group_ctx_map, key);
-    if (slot)
-        return slot;
+    if (!(mask & 0xffff)) {
+        n += 16;
+        mask >>= 16;
+    }
+    if (!(mask & 0xff)) {
+        n += 8;
+        mask >>= 8;
+    }
+    if (!(mask & 0xf)) {
+        n += 4;
+        mask >>= 4;
+    }
+    if (!(mask & 0x3)) {
+        n += 2;
+        mask >>= 2;
+    }
+    if (!(mask & 0x1))
+        n += 1;
 
-    bpf_map_update_elem(&group_ctx_map, key, &empty, BPF_NOEXIST);
-    return bpf_map_lookup_elem(&group_ctx_map, key);
+    return n;
 }
 
-/* 根据静态优先级和 cgroup/scx 权重计算权重倒数 wmult。
- * 后续会用它把真实运行时间换算成 vruntime 增量。
- */
-static __always_inline u64 clutch_compute_wmult(struct task_struct *p, int idx)
+/* 读取 cluster 内某个 bucket 当前的绝对 deadline。 */
+static __always_inline u64 clutch_bucket_abs_deadline(struct cluster_ctx *cluster, u32 bucket_id)
 {
-    u64 base_w = clutch_prio_to_weight[idx];
-    u32 cg_w = p->scx.weight;
-
-    if (!cg_w || cg_w == NICE_0_LOAD)
-        return clutch_prio_to_wmult[idx];
-
-    base_w = (base_w * cg_w) / NICE_0_LOAD;
-    if (!base_w)
-        base_w = 1;
-
-    return ((u64)1 << 32) / base_w;
+    return READ_ONCE(cluster->bucket_deadline_ns[bucket_id & (MAX_CLUTCH_BUCKETS - 1)]);
 }
 
-/* 计算任务本次 dispatch 的时间片。
- * 当前实现固定返回默认时间片，后续可以在这里接入更复杂的策略。
+/* 把 bucket 的绝对 deadline 设为 now + WCEL，对应 XNU 的
+ * sched_clutch_root_bucket_deadline_update()。
  */
-static __always_inline u64 clutch_calculate_slice(struct task_struct *p)
+static __always_inline void clutch_bucket_arm_deadline(struct cluster_ctx *cluster,
+                                                       u32 bucket_id, u64 now)
 {
-    return DEFAULT_SLICE_NS;
+    WRITE_ONCE(cluster->bucket_deadline_ns[bucket_id & (MAX_CLUTCH_BUCKETS - 1)],
+               now + clutch_bucket_deadline_ns(bucket_id));
 }
 
-/* 在持有 group 锁的情况下，用组内最小 vruntime 的线程刷新组级元数据。
- * 返回 false 表示组内已经没有线程可供调度。
+/* 在非空 bucket 位图中按绝对 deadline 做 EDF 选择；deadline 相同时选编号更小的 bucket。
+ * 低优先级 bucket 的 deadline 不随选择推进，等待超过 WCEL 后必然排到前面，
+ * 因此每个 bucket 的最坏等待时间都有界，而不是严格优先级。
  */
-static __always_inline bool clutch_refresh_group_key_locked(struct group_ctx *group)
+static __always_inline s32 clutch_edf_bucket(struct cluster_ctx *cluster, u32 mask)
 {
-    struct bpf_rb_node *rb;
-    struct clutch_se *thread_se;
+    s32 best_bucket = -1;
+    u64 best_ddl = 0;
+    u32 i;
 
-    rb = bpf_rbtree_first(&group->thread_cfs_rq);
-    if (!rb)
-        return false;
+    for (i = 0; i < MAX_CLUTCH_BUCKETS && mask; i++) {
+        u32 bucket_id = clutch_ffs(mask);
+        u64 ddl;
 
-    thread_se = container_of(rb, struct clutch_se, rb_node);
-    group->vruntime = thread_se->vruntime;
-    group->dispatch_cpu = thread_se->dispatch_cpu;
-    return true;
-}
+        mask &= mask - 1;
+        ddl = clutch_bucket_abs_deadline(cluster, bucket_id);
+        if (best_bucket < 0 || ddl < best_ddl) {
+            best_bucket = (s32)bucket_id;
+            best_ddl = ddl;
+        }
+    }
 
-/* 把 group_ctx 中的最新状态同步到 group_se。
- * group_se 是放在 bucket 红黑树中的轻量级“组调度实体”节点。
- * 每个入队线程都会生成一个线程令牌，支持同一线程的并发调度令牌被多个 CPU 消费。
- */
-static __always_inline void clutch_sync_group_se(struct clutch_se *group_se,
-                                                 struct group_ctx *slot)
-{
-    group_se->pid = slot->pid;
-    group_se->cluster_id = slot->cluster_id;
-    group_se->bucket_id = slot->bucket_id;
-    group_se->dispatch_cpu = slot->dispatch_cpu;
-    group_se->nr_children = slot->nr_children;
-    group_se->vruntime = slot->vruntime;
-    group_se->seq = slot->seq;
+    return best_bucket;
 }
 
-/* 为一个组分配新的 group_se 节点，供 bucket 红黑树使用。 */
-static __always_inline struct clutch_se *
-clutch_alloc_group_se(const struct group_key *key, u32 bucket_id)
+/* 读取 bucket 的 warp 预算；未启用的 bucket 没有预算。 */
+static __always_inline u64 clutch_bucket_warp_budget(u32 bucket_id)
 {
-    struct clutch_se *group_se;
+    if (bucket_id >= clutch_nr_buckets())
+        return 0;
 
-    group_se = bpf_obj_new(typeof(*group_se));
-    if (!group_se)
-        return NULL;
+    return clutch_bucket_warp_ns[bucket_id];
+}
 
-    group_se->pid = (s32)key->group_id;
-    group_se->cluster_id = key->cluster_id;
-    group_se->bucket_id = bucket_id;
-    group_se->dispatch_cpu = -1;
+/* 把 bucket 的 warp 预算补满并关闭 warp 窗口。bucket 变空时调用，不含 helper，可在锁内执行。 */
+static __always_inline void clutch_bucket_refill_warp(struct cluster_ctx *cluster, u32 bucket_id)
+{
+    u32 idx = bucket_id & (MAX_CLUTCH_BUCKETS - 1);
 
-    return group_se;
+    WRITE_ONCE(cluster->warp_deadline_ns[idx], 0);
+    WRITE_ONCE(cluster->warp_remaining_ns[idx], clutch_bucket_warp_budget(bucket_id));
 }
 
-/* 为待入队任务构造 thread_se 节点。
- * 这里会填充调度所需的权重、时间片、cluster/bucket 以及当前 vruntime。
+/* bucket 还有 warp 预算、且 warp 窗口尚未打开或尚未到期时可以越过 EDF 顺序。
+ * 窗口到期时把剩余预算清零；只有 CAS 成功的一方记一次 warp_exhausted。
  */
-static __always_inline struct clutch_se *
-clutch_alloc_thread_se(struct task_struct *p, struct thread_ctx *tctx,
-                       u32 cluster_id, u32 bucket_id, s32 preferred_cpu)
+static __always_inline bool clutch_bucket_can_warp(struct cluster_ctx *cluster, u32 bucket_id,
+                                                   u64 now)
 {
-    struct clutch_se *thread_se;
-    u64 wmult, slice_ns;
-    int idx;
-
-    thread_se = bpf_obj_new(typeof(*thread_se));
-    if (!thread_se)
-        return NULL;
-
-    idx = p->static_prio - MAX_RT_PRIO;
-    if (idx < 0)
-        idx = 0;
-    if (idx >= 40)
-        idx = 39;
+    u32 idx = bucket_id & (MAX_CLUTCH_BUCKETS - 1);
+    struct clutch_bucket_stats *bs;
+    u64 remaining, deadline;
 
-    wmult = clutch_compute_wmult(p, idx);
-    slice_ns = clutch_calculate_slice(p);
+    remaining = READ_ONCE(cluster->warp_remaining_ns[idx]);
+    if (!remaining)
+        return false;
 
-    thread_se->pid = p->pid;
-    thread_se->tgid = p->tgid;
-    thread_se->cluster_id = cluster_id;
-    thread_se->bucket_id = bucket_id;
-    thread_se->dispatch_cpu = preferred_cpu;
-    thread_se->wmult = wmult;
-    thread_se->slice_ns = slice_ns;
-    thread_se->vruntime = tctx->vruntime;
+    deadline = READ_ONCE(cluster->warp_deadline_ns[idx]);
+    if (!deadline || now < deadline)
+        return true;
 
-    tctx->wmult = wmult;
-    tctx->cluster_id = cluster_id;
-    tctx->bucket_id = bucket_id;
-    tctx->preferred_cpu = preferred_cpu;
-    if (!tctx->is_running)
-        tctx->run_cpu = -1;
+    if (__sync_val_compare_and_swap(&cluster->warp_remaining_ns[idx], remaining, 0) == remaining) {
+        bs = clutch_bucket_stats(bucket_id);
+        if (bs)
+            bs->warp_exhausted++;
+    }
 
-    return thread_se;
+    return false;
 }
 
-/* 把线程令牌节点插入 bucket 的红黑树。
- * bucket 层只关心“这个线程令牌当前最该被调度的线程是谁”，不直接保存线程本体。
+/* 先按 EDF 选出 bucket，再看是否有编号更小（优先级更高）的非空 bucket 还能 warp，
+ * 有则改选其中编号最小者，并通过 warped 告诉调用方这次选择越过了 EDF 顺序。
  */
-static __always_inline void clutch_bucket_add_group(struct bucket_ctx *bucket,
-                                                    struct clutch_se *group_se)
+static __always_inline s32 clutch_select_bucket(struct cluster_ctx *cluster, u32 mask,
+                                                bool *warped)
 {
-    if (!bucket || !group_se)
-        return;
+    s32 edf_bucket = clutch_edf_bucket(cluster, mask);
+    u64 now;
+    u32 i;
 
-    bpf_spin_lock(&bucket->lock);
-    bpf_rbtree_add(&bucket->group_cfs_rq, &group_se->rb_node, clutch_group_less);
-    bucket->nr_groups++;
-    bpf_spin_unlock(&bucket->lock);
+    *warped = false;
+    if (edf_bucket <= 0)
+        return edf_bucket;
+
+    now = bpf_ktime_get_ns();
+    for (i = 0; i < MAX_CLUTCH_BUCKETS && i < (u32)edf_bucket; i++) {
+        if (!(mask & (1U << i)))
+            continue;
+        if (clutch_bucket_can_warp(cluster, i, now)) {
+            *warped = true;
+            return (s32)i;
+        }
+    }
+
+    return edf_bucket;
 }
 
-/* 把线程挂入所属槽位（沿用 group 命名），并在 bucket 中放入一个新的线程令牌。
- * 令牌按线程维度生成，允许同一线程存在多个并发调度令牌。
+/* 在持有 bucket 锁时维护 cluster 的非空 bucket 位图。
+ * 同一 bucket 的置位/清位由 bucket 锁串行化，不同 bucket 之间只靠原子位操作，
+ * 读者无需任何锁。bucket 由空变为非空时按 now 重新设定它的绝对 deadline，
+ * 变空时补满 warp 预算；锁内不能调用 helper，now 由调用方在加锁前取好。
  */
-static __always_inline int clutch_queue_thread(struct group_ctx *slot,
-                                               const struct group_key *key,
-                                               struct clutch_se *thread_se)
+static __always_inline void clutch_cluster_mark_bucket(struct cluster_ctx *cluster,
+                                                       u32 bucket_id, bool nonempty, u64 now)
 {
-    struct clutch_se *group_se;
-    struct bucket_ctx *bucket;
+    u64 bit = 1ULL << (bucket_id & (MAX_CLUTCH_BUCKETS - 1));
 
-    group_se = clutch_alloc_group_se(key, thread_se->bucket_id);
-    if (!group_se) {
-        bpf_obj_drop(thread_se);
-        return -1;
+    if (!nonempty) {
+        __sync_fetch_and_and(&cluster->bucket_mask, ~bit);
+        clutch_bucket_refill_warp(cluster, bucket_id);
+        return;
     }
 
-    bucket = clutch_bucket_ctx(key->cluster_id, thread_se->bucket_id);
-    if (!bucket) {
-        bpf_obj_drop(group_se);
-        bpf_obj_drop(thread_se);
-        return -1;
-    }
+    if (!(__sync_fetch_and_or(&cluster->bucket_mask, bit) & bit))
+        clutch_bucket_arm_deadline(cluster, bucket_id, now);
+}
 
-    bpf_spin_lock(&slot->lock);
-    if (bpf_rbtree_add(&slot->thread_cfs_rq, &thread_se->rb_node, clutch_thread_less)) {
-        bpf_spin_unlock(&slot->lock);
-        bpf_obj_drop(group_se);
-        return -1;
+/* bucket 被选中并派发出一个线程后调用：超过 deadline 才被服务的记一次 miss。
+ * 按 EDF 选中时把 deadline 重新设为 now + WCEL，让其它 bucket 有机会排到它前面；
+ * 靠 warp 选中时 deadline 保持不变，首次 warp 打开一个长度为剩余预算的窗口，
+ * 窗口到期前该 bucket 都可以继续越过 EDF 顺序。
+ */
+static __always_inline void clutch_bucket_selected(struct cluster_ctx *cluster, u32 bucket_id,
+                                                   bool warped)
+{
+    u32 idx = bucket_id & (MAX_CLUTCH_BUCKETS - 1);
+    struct clutch_bucket_stats *bs;
+    u64 now = bpf_ktime_get_ns();
+    u64 ddl = clutch_bucket_abs_deadline(cluster, bucket_id);
+
+    bs = clutch_bucket_stats(bucket_id);
+    if (bs) {
+        bs->selected++;
+        if (now > ddl) {
+            bs->deadline_miss++;
+            bs->miss_ns += now - ddl;
+        }
+        if (warped)
+            bs->warp++;
     }
-    slot->nr_children++;
-    clutch_refresh_group_key_locked(slot);
-    slot->seq++;
-    clutch_sync_group_se(group_se, slot);
-    bpf_spin_unlock(&slot->lock);
 
-    if (!group_se->nr_children) {
-        bpf_obj_drop(group_se);
-        return -1;
+    if (!warped) {
+        clutch_bucket_arm_deadline(cluster, bucket_id, now);
+        return;
     }
 
-    clutch_bucket_add_group(bucket, group_se);
-    return 0;
+    if (!READ_ONCE(cluster->warp_deadline_ns[idx]))
+        WRITE_ONCE(cluster->warp_deadline_ns[idx],
+                   now + READ_ONCE(cluster->warp_remaining_ns[idx]));
 }
 
-/* 把一个任务接入 clutch 调度结构。
- * 过程包括：获取任务私有上下文、确定 preferred cpu/cluster/bucket、找到线程槽位、
- * 创建线程节点，并把它加入线程树和 bucket 树。
+/* 有新工作进入 cluster 时唤醒该 cluster 内的一个空闲 CPU。
+ * scx_bpf_pick_idle_cpu() 在 cluster cpumask 与全局空闲掩码的交集里挑选并占用一个 CPU，
+ * 避免多个并发入队重复踢同一个 CPU；cluster 内没有空闲 CPU 时返回 false。
  */
-static __always_inline int clutch_enqueue_thread(struct task_struct *p)
+static __always_inline bool clutch_kick_idle_cpu(u32 cluster_id)
 {
-    struct thread_ctx *tctx;
-    struct clutch_se *thread_se;
-    struct group_ctx *slot;
-    struct group_key key;
-    s32 preferred_cpu;
-    u32 cluster_id, bucket_id;
-
-    tctx = bpf_task_storage_get(&thread_ctx_map, p, 0,
-                                BPF_LOCAL_STORAGE_GET_F_CREATE);
-    if (!tctx)
-        return -1;
-
-    preferred_cpu = clutch_pick_preferred_cpu(p);
-    cluster_id = clutch_cpu_to_cluster(preferred_cpu);
-    bucket_id = clutch_bucket_id(p->pid);
-
-    key.cluster_id = cluster_id;
-    key.group_id = (u32)p->pid;
-
-    slot = clutch_group_ctx(&key);
-    if (!slot)
-        return -1;
+    struct cluster_ctx *cluster;
+    struct bpf_cpumask *mask;
+    s32 cpu = -1;
 
-    slot->cluster_id = cluster_id;
-    slot->pid = p->pid;
-    slot->bucket_id = bucket_id;
+    cluster = clutch_cluster_ctx(cluster_id);
+    if (!cluster)
+        return false;
 
-    thread_se = clutch_alloc_thread_se(p, tctx, cluster_id, bucket_id, preferred_cpu);
-    if (!thread_se)
-        return -1;
+    bpf_rcu_read_lock();
+    mask = cluster->cpumask;
+    if (mask)
+        cpu = scx_bpf_pick_idle_cpu(cast_mask(mask), 0);
+    bpf_rcu_read_unlock();
 
-    if (clutch_queue_thread(slot, &key, thread_se))
-        return -1;
+    if (cpu < 0)
+        return false;
 
-    return 0;
+    scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
+    clutch_stat_inc(CLUTCH_STAT_KICK_IDLE);
+    return true;
 }
 
-/* 把选中的线程真正 dispatch 到某个 CPU。
- * dispatch 只负责把任务放进目标 DSQ；真正开始运行的时点由 running 回调记录。
+/* cluster 内没有空闲 CPU 时，找出正在运行最低优先级工作（bucket 绝对 deadline 最晚）
+ * 的 CPU；只有它的 deadline 严格晚于新入队 bucket 时才用 SCX_KICK_PREEMPT 抢占。
+ * preempt_pending 保证同一个 CPU 在下一次 running 之前只被踢一次。
  */
-static __noinline int clutch_dispatch_thread(struct clutch_se *thread_se, s32 cpu)
+static __always_inline void clutch_preempt_cpu(u32 cluster_id, u32 bucket_id)
 {
-    struct task_struct *p;
-    struct thread_ctx *tctx;
-    s32 target_cpu;
+    struct cluster_ctx *cluster;
+    struct cluster_cpus *cc;
+    struct cpu_run_state *st;
+    u64 worst_ddl;
+    s32 victim = -1;
+    u32 nr;
+    int i;
 
-    p = bpf_task_from_pid(thread_se->pid);
+    cluster = clutch_cluster_ctx(cluster_id);
+    cc = bpf_map_lookup_elem(&cluster_cpus_map, &cluster_id);
+    if (!cluster || !cc)
+        return;
+
+    worst_ddl = clutch_bucket_abs_deadline(cluster, bucket_id);
+
+    nr = cc->nr;
+    bpf_for(i, 0, CLUTCH_MAX_CLUSTER_CPUS) {
+        u32 cpu;
+        u64 ddl;
+
+        if ((u32)i >= nr)
+            break;
+
+        cpu = cc->cpus[i];
+        st = bpf_map_lookup_elem(&cpu_run_state_map, &cpu);
+        if (!st || !READ_ONCE(st->valid) || READ_ONCE(st->preempt_pending))
+            continue;
+
+        ddl = clutch_bucket_abs_deadline(cluster, READ_ONCE(st->bucket_id));
+        if (ddl > worst_ddl) {
+            worst_ddl = ddl;
+            victim = (s32)cpu;
+        }
+    }
+
+    if (victim < 0)
+        return;
+
+    st = bpf_map_lookup_elem(&cpu_run_state_map, &victim);
+    if (!st || __sync_val_compare_and_swap(&st->preempt_pending, 0, 1))
+        return;
+
+    scx_bpf_kick_cpu(victim, SCX_KICK_PREEMPT);
+    clutch_stat_inc(CLUTCH_STAT_PREEMPT_KICK);
+}
+
+/* 入队后的唤醒策略：优先唤醒空闲 CPU，没有空闲 CPU 时再尝试抢占。 */
+static __always_inline void clutch_kick_cluster(u32 cluster_id, u32 bucket_id)
+{
+    if (clutch_kick_idle_cpu(cluster_id) || preempt_disabled)
+        return;
+
+    clutch_preempt_cpu(cluster_id, bucket_id);
+}
+
+/* bucket 的基准时间片，未配置时回退到 DEFAULT_SLICE_NS。 */
+static __always_inline u64 clutch_bucket_base_slice(u32 bucket_id)
+{
+    if (bucket_id >= MAX_CLUTCH_BUCKETS)
+        bucket_id = MAX_CLUTCH_BUCKETS - 1;
+
+    return clutch_bucket_slice_ns[bucket_id] ?: DEFAULT_SLICE_NS;
+}
+
+/* 按 group_key 查找组状态。
+ * 如果该组还不存在，就在 map 中创建一个空的 group_ctx；map 已满时记一次 group_full，
+ * 调用方随后会回退到全局 DSQ。
+ * 新组（包括被回收后重建的组）的平均 vruntime 以第一个进入者的 vruntime（seed）起步，
+ * 之后进入的线程都相对它放置，组内 vruntime 始终处在同一个坐标系中。
+ */
+static __always_inline struct group_ctx *clutch_group_ctx(const struct group_key *key, u64 seed)
+{
+    u64 now = bpf_ktime_get_ns();
+    struct group_ctx empty = {
+        .group_id = key->group_id,
+        .cluster_id = key->cluster_id,
+        .bucket_id = key->bucket_id,
+        .interactivity = CLUTCH_INTERACTIVE_PRI,
+        .ts_pri = CLUTCH_TS_USAGE_PRI + CLUTCH_INTERACTIVE_PRI,
+        .last_active_ns = now,
+        .usage_update_ns = now,
+        .vlag = -(s64)clutch_bucket_base_slice(key->bucket_id),
+        .lag_valid = true,
+        .avg = {
+            .base = seed,
+            .cur = seed,
+        },
+    };
+    struct group_ctx *slot;
+
+    slot = bpf_map_lookup_elem(&group_ctx_map, key);
+    if (slot)
+        return slot;
+
+    if (!bpf_map_update_elem(&group_ctx_map, key, &empty, BPF_NOEXIST))
+        clutch_stat_inc(CLUTCH_STAT_GROUP_CREATE);
+
+    slot = bpf_map_lookup_elem(&group_ctx_map, key);
+    if (!slot)
+        clutch_stat_inc(CLUTCH_STAT_GROUP_FULL);
+
+    return slot;
+}
+
+/* 组为空、不在 bucket 树中且已空闲至少 idle_ns 时删除它。
+ * 先在锁内置 dead，让仍持有旧指针的入队路径改去重新创建组，再从 map 删除。
+ * now 由调用方在遍历前取好，期间 dispatch 可能写入更晚的 last_active_ns，
+ * 此时组刚刚活跃过，不能让相减回绕成很大的空闲时间。
+ */
+static __always_inline bool clutch_group_try_reap(struct group_ctx *slot,
+                                                  const struct group_key *key,
+                                                  u64 now, u64 idle_ns)
+{
+    bool reap;
+
+    bpf_spin_lock(&slot->lock);
+    reap = !slot->dead && !slot->queued && !slot->nr_children &&
+           slot->last_active_ns < now && now - slot->last_active_ns >= idle_ns;
+    if (reap)
+        slot->dead = 1;
+    bpf_spin_unlock(&slot->lock);
+
+    if (!reap || bpf_map_delete_elem(&group_ctx_map, key))
+        return false;
+
+    clutch_stat_inc(CLUTCH_STAT_GROUP_EVICT);
+    return true;
+}
+
+/* 线程离开某个组（退出或换了 cluster/bucket）后，若该组已经空了就立即删除。 */
+static __always_inline void clutch_group_release(const struct group_key *key)
+{
+    struct group_ctx *slot;
+
+    slot = bpf_map_lookup_elem(&group_ctx_map, key);
+    if (slot)
+        clutch_group_try_reap(slot, key, bpf_ktime_get_ns(), 0);
+}
+
+/* 根据静态优先级和 cgroup/scx 权重计算权重倒数 wmult。
+ * 后续会用它把真实运行时间换算成 vruntime 增量。
+ */
+static __always_inline u64 clutch_compute_wmult(struct task_struct *p, int idx)
+{
+    u64 base_w = clutch_prio_to_weight[idx];
+    u32 cg_w = p->scx.weight;
+
+    if (!cg_w || cg_w == NICE_0_LOAD)
+        return clutch_prio_to_wmult[idx];
+
+    base_w = (base_w * cg_w) / NICE_0_LOAD;
+    if (!base_w)
+        base_w = 1;
+
+    return ((u64)1 << 32) / base_w;
+}
+
+/* 按任务的 nice 与 cgroup/scx 权重计算 wmult。 */
+static __always_inline u64 clutch_task_wmult(struct task_struct *p)
+{
+    int idx;
+
+    idx = p->static_prio - MAX_RT_PRIO;
+    if (idx < 0)
+        idx = 0;
+    if (idx >= 40)
+        idx = 39;
+
+    return clutch_compute_wmult(p, idx);
+}
+
+/* 把一段真实运行时间按 wmult 折算成 vruntime 增量。 */
+static __always_inline u64 clutch_scale_delta(u64 delta_ns, u64 wmult)
+{
+    return (delta_ns * NICE_0_LOAD * wmult) >> 32;
+}
+
+/* 读取任务所在默认层级 cgroup 的 kernfs id，即 cgroup 目录的 inode 号；读不到时返回 0。 */
+static __always_inline u64 clutch_task_cgroup_id(struct task_struct *p)
+{
+    struct css_set *cset;
+    struct cgroup *cgrp;
+    u64 id = 0;
+
+    bpf_rcu_read_lock();
+    cset = p->cgroups;
+    cgrp = cset ? cset->dfl_cgrp : NULL;
+    if (cgrp && cgrp->kn)
+        id = cgrp->kn->id;
+    bpf_rcu_read_unlock();
+
+    return id;
+}
+
+/* 按 --group-by 计算线程所属组的 id。
+ * cgroup 模式取 cgroup id 的低 32 位，在存活的 cgroup 之间唯一；读不到时归入 id 0。
+ */
+static __always_inline u32 clutch_task_group_id(struct task_struct *p)
+{
+    if (clutch_group_by == CLUTCH_GROUP_BY_TGID)
+        return (u32)p->tgid;
+    if (clutch_group_by != CLUTCH_GROUP_BY_CGROUP)
+        return (u32)p->pid;
+
+    return (u32)clutch_task_cgroup_id(p);
+}
+
+/* 没有覆盖项时按调度策略与 nice 分类：SCHED_IDLE 归 BG，SCHED_BATCH 归 UT；
+ * 普通线程 nice <= -10 为 FG，其余负 nice 为 IN，nice 0 为 DF，
+ * 正 nice 为 UT，nice >= 10 为 BG。
+ */
+static __always_inline u32 clutch_qos_default_bucket(struct task_struct *p)
+{
+    int nice = p->static_prio - DEFAULT_PRIO;
+
+    if (p->policy == SCHED_IDLE)
+        return CLUTCH_BUCKET_BG;
+    if (p->policy == SCHED_BATCH)
+        return CLUTCH_BUCKET_UT;
+
+    if (nice <= -10)
+        return CLUTCH_BUCKET_FG;
+    if (nice < 0)
+        return CLUTCH_BUCKET_IN;
+    if (!nice)
+        return CLUTCH_BUCKET_DF;
+    if (nice < 10)
+        return CLUTCH_BUCKET_UT;
+    return CLUTCH_BUCKET_BG;
+}
+
+/* 入队时为线程选择 bucket，依次看 tgid 覆盖、cgroup 覆盖、调度策略与 nice。
+ * 结果连同输入（策略与 static_prio、cgroup id）缓存在 thread_ctx 中，输入都没变时不再查覆盖表；
+ * 覆盖表只在 attach 之前由 loader 写入，运行中不会变化。新建的 thread_ctx 中 prio_key 为 0，
+ * 不会与任何真实任务相等，第一次入队必然分类。超出活跃 bucket 数的结果归入最后一个 bucket。
+ */
+static __always_inline u32 clutch_bucket_id(struct task_struct *p, struct thread_ctx *tctx)
+{
+    u32 nr_buckets = clutch_nr_buckets();
+    u32 prio_key = ((u32)p->policy << 16) | (u32)p->static_prio;
+    u64 cgroup_id = clutch_task_cgroup_id(p);
+    u32 tgid = (u32)p->tgid;
+    u32 *override;
+    u32 bucket_id;
+
+    if (tctx->qos_prio_key == prio_key &&
+        tctx->qos_cgroup_id == cgroup_id) {
+        bucket_id = tctx->qos_bucket;
+    } else {
+        override = bpf_map_lookup_elem(&qos_tgid_map, &tgid);
+        if (!override)
+            override = bpf_map_lookup_elem(&qos_cgroup_map, &cgroup_id);
+        bucket_id = override ? *override : clutch_qos_default_bucket(p);
+
+        tctx->qos_prio_key = prio_key;
+        tctx->qos_cgroup_id = cgroup_id;
+        tctx->qos_bucket = bucket_id;
+        clutch_stat_inc(CLUTCH_STAT_QOS_CLASSIFY);
+    }
+
+    return bucket_id < nr_buckets ? bucket_id : nr_buckets - 1;
+}
+
+/* 把线程本次入队确定的 cluster/bucket/偏好 CPU 与权重写回 thread_ctx，
+ * running/stopping 的记账依赖这些字段。返回计算出的 wmult。
+ */
+static __always_inline u64 clutch_update_thread_ctx(struct task_struct *p,
+                                                    struct thread_ctx *tctx,
+                                                    u32 cluster_id, u32 bucket_id,
+                                                    s32 preferred_cpu)
+{
+    u64 wmult = clutch_task_wmult(p);
+
+    tctx->wmult = wmult;
+    tctx->cluster_id = cluster_id;
+    tctx->bucket_id = bucket_id;
+    tctx->preferred_cpu = preferred_cpu;
+    if (!tctx->is_running)
+        tctx->run_cpu = -1;
+
+    return wmult;
+}
+
+/* DSQ 引擎：每个 (cluster, bucket) 一个 sched_ext 自建 vtime DSQ，
+ * 由内核维护队列与锁，用来和手写红黑树引擎对比入队/派发开销。
+ */
+static __always_inline u64 clutch_bucket_dsq_id(u32 cluster_id, u32 bucket_id)
+{
+    return CLUTCH_BUCKET_DSQ_BASE + (u64)cluster_id * MAX_CLUTCH_BUCKETS + bucket_id;
+}
+
+/* 返回 cluster 当前排队等待的线程数，作为窃取和计算时间片时衡量负载的依据。 */
+static __always_inline u64 clutch_cluster_load(u32 cluster_id)
+{
+    struct cluster_ctx *cluster;
+    u32 nr_buckets = clutch_nr_buckets();
+    u64 load = 0;
+    u32 i;
+
+    if (clutch_engine == CLUTCH_ENGINE_DSQ) {
+        for (i = 0; i < MAX_CLUTCH_BUCKETS && i < nr_buckets; i++) {
+            s32 nr = scx_bpf_dsq_nr_queued(clutch_bucket_dsq_id(cluster_id, i));
+
+            if (nr > 0)
+                load += nr;
+        }
+        return load;
+    }
+
+    cluster = clutch_cluster_ctx(cluster_id);
+    return cluster ? READ_ONCE(cluster->nr_queued) : 0;
+}
+
+/* 计算一次 dispatch 的时间片：取 bucket 的基准时间片，cluster 内排队线程数
+ * 超过 cluster 的 CPU 数时按 CPU 数 / 排队数等比缩短，再夹到
+ * [clutch_slice_min_ns, clutch_slice_max_ns]。这样竞争激烈时前台 bucket 轮转更快，
+ * 负载轻时后台 bucket 一次跑得更久、少付切换开销。
+ * 只做计算，不记统计；真正交给任务的时间片由 clutch_record_slice() 记录。
+ */
+static __always_inline u64 clutch_calculate_slice(u32 cluster_id, u32 bucket_id)
+{
+    struct cluster_cpus *cc;
+    u64 slice, load, nr_cpus = 1;
+
+    slice = clutch_bucket_base_slice(bucket_id);
+
+    cc = bpf_map_lookup_elem(&cluster_cpus_map, &cluster_id);
+    if (cc && cc->nr)
+        nr_cpus = cc->nr;
+
+    load = clutch_cluster_load(cluster_id);
+    if (load > nr_cpus)
+        slice = slice * nr_cpus / load;
+
+    if (slice < clutch_slice_min_ns)
+        slice = clutch_slice_min_ns;
+    if (clutch_slice_max_ns && slice > clutch_slice_max_ns)
+        slice = clutch_slice_max_ns;
+
+    return slice;
+}
+
+/* 把交给任务的时间片按 bucket 记入 clutch_bucket_stats 的直方图（以 1ms 起倍增分档），
+ * 返回 slice 本身。只在任务真正带着这个时间片被派发或插入 DSQ 时调用，
+ * 回退到全局 DSQ 与落空的派发尝试不计入。
+ */
+static __always_inline u64 clutch_record_slice(u32 bucket_id, u64 slice)
+{
+    struct clutch_bucket_stats *bs;
+    u32 bin;
+
+    bs = clutch_bucket_stats(bucket_id);
+    if (!bs)
+        return slice;
+
+    for (bin = 0; bin < CLUTCH_SLICE_HIST_BINS - 1; bin++) {
+        if (slice < (CLUTCH_SLICE_HIST_BASE_NS << bin))
+            break;
+    }
+    bs->slices++;
+    bs->slice_ns += slice;
+    bs->slice_hist[bin]++;
+
+    return slice;
+}
+
+/* 回退到全局 DSQ 时的时间片：按任务当前 CPU 所在 cluster 和上次分类的 bucket 计算。 */
+static __always_inline u64 clutch_task_slice(struct task_struct *p)
+{
+    struct thread_ctx *tctx;
+
+    tctx = bpf_task_storage_get(&thread_ctx_map, p, 0, 0);
+    return clutch_calculate_slice(clutch_cpu_to_cluster(scx_bpf_task_cpu(p)),
+                                  tctx ? tctx->bucket_id : CLUTCH_BUCKET_DF);
+}
+
+/* 把一个不在任何红黑树中的节点放回当前 CPU 的对象池。
+ * 池满或槽位不可用时直接释放，返回 -1。
+ */
+static __always_inline int clutch_se_stash(struct clutch_se_pool *pool,
+                                           struct clutch_se *se)
+{
+    struct clutch_se_stash *slot;
+    struct clutch_se *old;
+    u32 idx = pool->nr_free;
+
+    if (idx >= CLUTCH_SE_POOL_SIZE) {
+        bpf_obj_drop(se);
+        return -1;
+    }
+
+    slot = bpf_map_lookup_elem(&clutch_se_stash_map, &idx);
+    if (!slot) {
+        bpf_obj_drop(se);
+        return -1;
+    }
+
+    old = bpf_kptr_xchg(&slot->node, se);
+    if (old)
+        bpf_obj_drop(old);
+
+    pool->nr_free = idx + 1;
+    return 0;
+}
+
+/* 对象池取空后按批次预分配节点，把 bpf_obj_new 的开销摊到多次入队上。 */
+static __always_inline void clutch_se_pool_refill(struct clutch_se_pool *pool)
+{
+    u32 i;
+
+    for (i = 0; i < CLUTCH_SE_POOL_REFILL; i++) {
+        struct clutch_se *se;
+
+        if (pool->nr_free >= CLUTCH_SE_POOL_SIZE)
+            break;
+
+        se = bpf_obj_new(typeof(*se));
+        if (!se)
+            break;
+
+        if (clutch_se_stash(pool, se))
+            break;
+
+        clutch_stat_inc(CLUTCH_STAT_SE_POOL_REFILL);
+    }
+}
+
+/* 分配一个 clutch_se 节点。
+ * 优先从当前 CPU 的对象池弹出；池空时记一次 miss，先批量补池再直接分配。
+ * 复用的节点会被清零，调用方看到的状态与 bpf_obj_new 一致。
+ */
+static __always_inline struct clutch_se *clutch_se_alloc(void)
+{
+    struct clutch_se_stash *slot;
+    struct clutch_se_pool *pool;
+    struct clutch_se *se = NULL;
+    u32 key = 0, idx;
+
+    pool = bpf_map_lookup_elem(&clutch_se_pool_map, &key);
+    if (pool && pool->nr_free) {
+        idx = pool->nr_free - 1;
+        pool->nr_free = idx;
+
+        slot = bpf_map_lookup_elem(&clutch_se_stash_map, &idx);
+        if (slot)
+            se = bpf_kptr_xchg(&slot->node, NULL);
+    }
+
+    if (se) {
+        se->pid = 0;
+        se->tgid = 0;
+        se->dispatch_cpu = 0;
+        se->cluster_id = 0;
+        se->bucket_id = 0;
+        se->nr_children = 0;
+        se->vruntime = 0;
+        se->deadline = 0;
+        se->wmult = 0;
+        se->slice_ns = 0;
+        se->stop_ns = 0;
+        se->seq = 0;
+        se->eligible = false;
+        clutch_stat_inc(CLUTCH_STAT_SE_POOL_HIT);
+        return se;
+    }
+
+    clutch_stat_inc(CLUTCH_STAT_SE_POOL_MISS);
+    if (pool)
+        clutch_se_pool_refill(pool);
+
+    return bpf_obj_new(typeof(*se));
+}
+
+/* 回收一个已经离开红黑树的节点；池满时才真正释放。
+ * 放回池之前先释放节点上仍持有的 task 引用，池中节点不持有任何引用。
+ */
+static __always_inline void clutch_se_free(struct clutch_se *se)
+{
+    struct clutch_se_pool *pool;
+    struct task_struct *task;
+    u32 key = 0;
+
+    task = bpf_kptr_xchg(&se->task, NULL);
+    if (task)
+        bpf_task_release(task);
+
+    pool = bpf_map_lookup_elem(&clutch_se_pool_map, &key);
+    if (!pool) {
+        bpf_obj_drop(se);
+        clutch_stat_inc(CLUTCH_STAT_SE_POOL_DROP);
+        return;
+    }
+
+    if (clutch_se_stash(pool, se)) {
+        clutch_stat_inc(CLUTCH_STAT_SE_POOL_DROP);
+        return;
+    }
+
+    clutch_stat_inc(CLUTCH_STAT_SE_POOL_RECYCLE);
+}
+
+/* 把 wmult 换回权重，nice 0 对应 NICE_0_LOAD。 */
+static __always_inline u64 clutch_wmult_weight(u64 wmult)
+{
+    u64 weight = wmult ? ((u64)1 << 32) / wmult : NICE_0_LOAD;
+
+    return weight ?: 1;
+}
+
+/* 线程的虚拟请求长度 slice / weight。请求取所属 bucket 的基准时间片；
+ * 任务用 sched_setattr 设置过更短的 sched_runtime（se.custom_slice）时按它计算，
+ * 这类短请求线程的虚拟 deadline 更早，在 EEVDF 模式下更快被选中。
+ */
+static __always_inline u64 clutch_thread_vslice(struct task_struct *p, u32 bucket_id, u64 wmult)
+{
+    u64 req = clutch_bucket_base_slice(bucket_id);
+
+    if (p->se.custom_slice && p->se.slice && p->se.slice < req)
+        req = p->se.slice;
+
+    return clutch_scale_delta(req, wmult);
+}
+
+/* 返回累加器当前的加权平均 vruntime；队列为空时返回最后一次的平均值。 */
+static __always_inline u64 clutch_avg_vruntime(const struct clutch_avg *avg)
+{
+    if (!avg->load)
+        return avg->base;
+    if (avg->vsum < 0)
+        return avg->base - (u64)(-avg->vsum) / avg->load;
+    return avg->base + (u64)avg->vsum / avg->load;
+}
+
+/* 一个 vruntime 为 v、权重为 w 的实体入队。队列由空变为非空时以 v 为新基准。 */
+static __always_inline void clutch_avg_add(struct clutch_avg *avg, u64 v, u64 weight)
+{
+    if (!avg->load) {
+        avg->base = v;
+        avg->vsum = 0;
+    }
+
+    avg->vsum += (s64)(v - avg->base) * (s64)weight;
+    avg->load += weight;
+    avg->cur = clutch_avg_vruntime(avg);
+}
+
+/* 一个实体出队。之后把基准挪到新的平均值上，vsum 始终保持在小范围内，
+ * 长时间不空的队列也不会因 vruntime 持续增长而溢出。
+ */
+static __always_inline void clutch_avg_sub(struct clutch_avg *avg, u64 v, u64 weight)
+{
+    u64 cur;
+
+    if (avg->load <= weight) {
+        avg->load = 0;
+        avg->vsum = 0;
+        return;
+    }
+
+    avg->vsum -= (s64)(v - avg->base) * (s64)weight;
+    avg->load -= weight;
+
+    cur = clutch_avg_vruntime(avg);
+    avg->vsum -= (s64)(cur - avg->base) * (s64)avg->load;
+    avg->base = cur;
+    avg->cur = cur;
+}
+
+/* 保留的 lag 上限：两个 bucket 基准时间片，按 wmult 折算成虚拟时间（组实体用 nice 0）。
+ * 睡了很久的实体回来时最多领先平均值这么多，跑得过多的实体也最多落后这么多。
+ */
+static __always_inline s64 clutch_lag_limit(u32 bucket_id, u64 wmult)
+{
+    return (s64)clutch_scale_delta(2 * clutch_bucket_base_slice(bucket_id), wmult);
+}
+
+/* 计算实体离开队列时的 lag = V - v，并夹到 [-limit, limit]。 */
+static __always_inline s64 clutch_entity_lag(u64 avg, u64 vruntime, s64 limit)
+{
+    s64 lag = (s64)(avg - vruntime);
+
+    if (lag > limit)
+        return limit;
+    if (lag < -limit)
+        return -limit;
+    return lag;
+}
+
+/* 按 EEVDF place_entity 的语义放置回到队列的实体：v = V - lag。 */
+static __always_inline u64 clutch_place_vruntime(u64 avg, s64 lag)
+{
+    if (lag > 0 && avg < (u64)lag)
+        return 0;
+
+    return avg - (u64)lag;
+}
+
+/* 返回下一个会被选中的实体而不摘下它：先看 EEVDF 可选队列，再看按 vruntime 排序的队列。
+ * 非 EEVDF 模式下可选队列始终为空，结果就是最小 vruntime 的实体。
+ */
+static __always_inline struct clutch_se *clutch_eevdf_peek_locked(struct bpf_rb_root *eligible,
+                                                                  struct bpf_rb_root *pending)
+{
+    struct bpf_rb_node *rb;
+
+    rb = bpf_rbtree_first(eligible);
+    if (!rb)
+        rb = bpf_rbtree_first(pending);
+
+    return rb ? container_of(rb, struct clutch_se, rb_node) : NULL;
+}
+
+/* 摘下 clutch_eevdf_peek_locked() 返回的实体。 */
+static __always_inline struct bpf_rb_node *
+clutch_eevdf_remove_locked(struct bpf_rb_root *eligible, struct bpf_rb_root *pending,
+                           struct clutch_se *se)
+{
+    if (se->eligible)
+        return bpf_rbtree_remove(eligible, &se->rb_node);
+    return bpf_rbtree_remove(pending, &se->rb_node);
+}
+
+/* 实体的 vruntime 不超过加权平均值（lag >= 0）时是 eligible 的。 */
+static __always_inline bool clutch_se_eligible(const struct clutch_se *se, u64 avg)
+{
+    return (s64)(se->vruntime - avg) <= 0;
+}
+
+/* 两队列 EEVDF 选取：pending 按 vruntime 排序，eligible 按虚拟 deadline 排序。
+ * 先把 eligible 队头中已经不再 eligible（平均值回落后 vruntime 超过平均值）的实体
+ * 退回 pending，再把 pending 队头中 eligible 的实体移入 eligible，两个方向每次各最多
+ * CLUTCH_EEVDF_MIGRATE_MAX 个，最后取 deadline 最早的实体。
+ * 退回预算用完时 eligible 队头仍可能不 eligible，此时改取 pending 队头：最小 vruntime
+ * 的实体总是 eligible，只要队列非空就一定能选出实体。
+ * 只检查 eligible 队头，队中更深处失去资格的实体要等排到队头才退回，
+ * 这是 BPF rbtree 没有增强字段时的近似。非 EEVDF 模式不做迁移，直接取最小 vruntime 的实体。
+ * group 为真时两棵树装的是组实体，退回 pending 时按组的排序函数插入。
+ */
+static __always_inline struct bpf_rb_node *
+clutch_eevdf_pop_locked(struct bpf_rb_root *eligible, struct bpf_rb_root *pending, u64 avg,
+                        bool group)
+{
+    struct bpf_rb_node *rb;
+    struct clutch_se *se;
+    int i;
+
+    if (!clutch_eevdf) {
+        rb = bpf_rbtree_first(pending);
+        return rb ? bpf_rbtree_remove(pending, rb) : NULL;
+    }
+
+    for (i = 0; i < CLUTCH_EEVDF_MIGRATE_MAX; i++) {
+        rb = bpf_rbtree_first(eligible);
+        if (!rb)
+            break;
+
+        se = container_of(rb, struct clutch_se, rb_node);
+        if (clutch_se_eligible(se, avg))
+            break;
+
+        rb = bpf_rbtree_remove(eligible, rb);
+        if (!rb)
+            break;
+
+        se = container_of(rb, struct clutch_se, rb_node);
+        se->eligible = false;
+        if (group)
+            bpf_rbtree_add(pending, &se->rb_node, clutch_group_less);
+        else
+            bpf_rbtree_add(pending, &se->rb_node, clutch_thread_less);
+    }
+
+    for (i = 0; i < CLUTCH_EEVDF_MIGRATE_MAX; i++) {
+        rb = bpf_rbtree_first(pending);
+        if (!rb)
+            break;
+
+        se = container_of(rb, struct clutch_se, rb_node);
+        if (!clutch_se_eligible(se, avg))
+            break;
+
+        rb = bpf_rbtree_remove(pending, rb);
+        if (!rb)
+            break;
+
+        se = container_of(rb, struct clutch_se, rb_node);
+        se->eligible = true;
+        bpf_rbtree_add(eligible, &se->rb_node, clutch_deadline_less);
+    }
+
+    rb = bpf_rbtree_first(eligible);
+    if (rb && !clutch_se_eligible(container_of(rb, struct clutch_se, rb_node), avg)) {
+        rb = bpf_rbtree_first(pending);
+        if (rb)
+            return bpf_rbtree_remove(pending, rb);
+        rb = bpf_rbtree_first(eligible);
+    }
+    if (!rb)
+        rb = bpf_rbtree_first(pending);
+    if (!rb)
+        return NULL;
+
+    se = container_of(rb, struct clutch_se, rb_node);
+    return clutch_eevdf_remove_locked(eligible, pending, se);
+}
+
+/* 在持有 group 锁的情况下，用组内下一个会被选中的线程刷新组级元数据。
+ * 组的 vruntime 是组级记账结果，不随队头线程变化，这里只刷新偏好 CPU
+ * 和组实体在 bucket 层使用的虚拟请求长度（队头线程的 deadline - vruntime）。
+ * 返回 false 表示组内已经没有线程可供调度。
+ */
+static __always_inline bool clutch_refresh_group_key_locked(struct group_ctx *group)
+{
+    struct clutch_se *thread_se;
+
+    thread_se = clutch_eevdf_peek_locked(&group->thread_eligible_rq, &group->thread_cfs_rq);
+    if (!thread_se)
+        return false;
+
+    group->dispatch_cpu = thread_se->dispatch_cpu;
+    group->head_vslice = thread_se->deadline > thread_se->vruntime ?
+                         thread_se->deadline - thread_se->vruntime : 0;
+    return true;
+}
+
+/* XNU clutch 风格的交互性分数，取值 0..2*CLUTCH_INTERACTIVE_PRI。
+ * 阻塞时间多于运行时间时分数高于 CLUTCH_INTERACTIVE_PRI，纯 CPU 密集的组趋近 0。
+ */
+static __always_inline u32 clutch_interactivity_score(u64 used_ns, u64 blocked_ns)
+{
+    if (blocked_ns > used_ns)
+        return CLUTCH_INTERACTIVE_PRI +
+               (u32)(CLUTCH_INTERACTIVE_PRI * (blocked_ns - used_ns) / blocked_ns);
+    if (!used_ns)
+        return CLUTCH_INTERACTIVE_PRI;
+
+    return (u32)(CLUTCH_INTERACTIVE_PRI * blocked_ns / used_ns);
+}
+
+/* 按距上次更新经过的时间做指数衰减：每过一个 CLUTCH_USAGE_HALFLIFE_NS 减半，
+ * 不足一个半衰期的部分在 value 与 value/2 之间线性近似。
+ * 调用方保证 value 不超过 CLUTCH_USAGE_MAX_NS，乘法不会溢出。
+ */
+static __always_inline u64 clutch_usage_decay(u64 value, u64 elapsed_ns)
+{
+    u64 halves = elapsed_ns / CLUTCH_USAGE_HALFLIFE_NS;
+    u64 rem;
+
+    if (halves >= 64)
+        return 0;
+
+    value >>= halves;
+    rem = elapsed_ns - halves * CLUTCH_USAGE_HALFLIFE_NS;
+    return value - (value >> 1) * rem / CLUTCH_USAGE_HALFLIFE_NS;
+}
+
+/* 分时优先级，取值 0..CLUTCH_TS_MAX_PRI，越大越优先。
+ * 以 CLUTCH_TS_USAGE_PRI 为基准，衰减后的 CPU 使用每 CLUTCH_TS_USAGE_UNIT_NS 降一级，
+ * 再加上交互性分数；对应 XNU 中 pri = base_pri - (cpu_usage >> pri_shift) + interactivity。
+ */
+static __always_inline u32 clutch_ts_pri(u64 used_ns, u32 interactivity)
+{
+    u64 penalty = used_ns / CLUTCH_TS_USAGE_UNIT_NS;
+
+    if (penalty > CLUTCH_TS_USAGE_PRI)
+        penalty = CLUTCH_TS_USAGE_PRI;
+
+    return CLUTCH_TS_USAGE_PRI - (u32)penalty + interactivity;
+}
+
+/* 在持有组锁时惰性刷新组的 CPU 使用统计：先把已有的运行/阻塞时间按经过的时间衰减，
+ * 再累加本次输入，最后重算交互性分数与分时优先级。入队和 stopping 时调用。
+ */
+static __always_inline void clutch_group_account_locked(struct group_ctx *slot, u64 used_ns,
+                                                        u64 blocked_ns, u64 now)
+{
+    u64 elapsed = now > slot->usage_update_ns ? now - slot->usage_update_ns : 0;
+
+    slot->cpu_used_ns = clutch_usage_decay(slot->cpu_used_ns, elapsed) + used_ns;
+    slot->cpu_blocked_ns = clutch_usage_decay(slot->cpu_blocked_ns, elapsed) + blocked_ns;
+    if (slot->cpu_used_ns > CLUTCH_USAGE_MAX_NS)
+        slot->cpu_used_ns = CLUTCH_USAGE_MAX_NS;
+    if (slot->cpu_blocked_ns > CLUTCH_USAGE_MAX_NS)
+        slot->cpu_blocked_ns = CLUTCH_USAGE_MAX_NS;
+    slot->usage_update_ns = now;
+
+    slot->interactivity = clutch_interactivity_score(slot->cpu_used_ns, slot->cpu_blocked_ns);
+    slot->ts_pri = clutch_ts_pri(slot->cpu_used_ns, slot->interactivity);
+}
+
+/* 分时优先级折算成的排序键偏移：优先级每低一级晚 CLUTCH_TS_PRI_NS，最多 48 * 125us = 6ms。 */
+static __always_inline u64 clutch_ts_penalty(u32 ts_pri)
+{
+    if (ts_pri > CLUTCH_TS_MAX_PRI)
+        ts_pri = CLUTCH_TS_MAX_PRI;
+
+    return (u64)(CLUTCH_TS_MAX_PRI - ts_pri) * CLUTCH_TS_PRI_NS;
+}
+
+/* 组在 bucket 树中的排序键：组 vruntime 加上分时优先级对应的偏移。
+ * 长时间占用 CPU 的组逐渐排到刚被唤醒的组后面，不需要手工调参。
+ */
+static __always_inline u64 clutch_group_key_vruntime(struct group_ctx *slot)
+{
+    return slot->vruntime + clutch_ts_penalty(slot->ts_pri);
+}
+
+/* 把 group_ctx 中的最新状态同步到 group_se。
+ * group_se 是放在 bucket 红黑树中的“组调度实体”节点，每个组至多一个；
+ * 每次（重新）插入 bucket 树之前都要用当前队头刷新一次排序键。
+ */
+static __always_inline void clutch_sync_group_se(struct clutch_se *group_se,
+                                                 struct group_ctx *slot)
+{
+    group_se->pid = (s32)slot->group_id;
+    group_se->cluster_id = slot->cluster_id;
+    group_se->bucket_id = slot->bucket_id;
+    group_se->dispatch_cpu = slot->dispatch_cpu;
+    group_se->nr_children = slot->nr_children;
+    group_se->vruntime = clutch_group_key_vruntime(slot);
+    group_se->deadline = group_se->vruntime + slot->head_vslice;
+    group_se->seq = slot->seq;
+}
+
+/* 为一个组分配新的 group_se 节点，供 bucket 红黑树使用。
+ * group_se 的 pid 字段保存组 id。
+ */
+static __always_inline struct clutch_se *
+clutch_alloc_group_se(const struct group_key *key)
+{
+    struct clutch_se *group_se;
+
+    group_se = clutch_se_alloc();
+    if (!group_se)
+        return NULL;
+
+    group_se->pid = (s32)key->group_id;
+    group_se->cluster_id = key->cluster_id;
+    group_se->bucket_id = key->bucket_id;
+    group_se->dispatch_cpu = -1;
+
+    return group_se;
+}
+
+/* 为待入队任务构造 thread_se 节点。
+ * 这里会填充调度所需的权重、时间片、cluster/bucket 以及当前 vruntime，
+ * 并在节点里持有一份 task 引用，dispatch 时直接使用，不再按 pid 反查。
+ * 节点的 seq 取自 thread_ctx 的入队序号，dequeue 推进序号后旧节点即失效。
+ */
+static __always_inline struct clutch_se *
+clutch_alloc_thread_se(struct task_struct *p, struct thread_ctx *tctx,
+                       u32 cluster_id, u32 bucket_id, s32 preferred_cpu)
+{
+    struct task_struct *ref, *old;
+    struct clutch_se *thread_se;
+    u64 wmult;
+
+    thread_se = clutch_se_alloc();
+    if (!thread_se)
+        return NULL;
+
+    ref = bpf_task_acquire(p);
+    if (!ref) {
+        clutch_se_free(thread_se);
+        return NULL;
+    }
+
+    old = bpf_kptr_xchg(&thread_se->task, ref);
+    if (old)
+        bpf_task_release(old);
+
+    wmult = clutch_update_thread_ctx(p, tctx, cluster_id, bucket_id, preferred_cpu);
+
+    thread_se->pid = p->pid;
+    thread_se->tgid = p->tgid;
+    thread_se->cluster_id = cluster_id;
+    thread_se->bucket_id = bucket_id;
+    thread_se->dispatch_cpu = preferred_cpu;
+    thread_se->wmult = wmult;
+    thread_se->slice_ns = 0;
+    thread_se->vruntime = tctx->vruntime;
+    thread_se->deadline = tctx->vruntime + clutch_thread_vslice(p, bucket_id, wmult);
+    thread_se->stop_ns = tctx->last_stop_ns;
+    thread_se->seq = ++tctx->enq_seq;
+
+    return thread_se;
+}
+
+/* 把组实体插入 bucket 的红黑树。
+ * bucket 层只关心“这个组当前最该被调度的线程是谁”，不直接保存线程本体。
+ * bucket 由空变为非空时同步置位 cluster 的 bucket 位图。
+ * requeue 为真表示 dispatch 把刚取出的组实体插回：它一直计在 nr_groups 中，不再重复计数。
+ */
+static __always_inline void clutch_bucket_add_group(struct cluster_ctx *cluster,
+                                                    struct bucket_ctx *bucket,
+                                                    struct clutch_se *group_se, bool requeue)
+{
+    u32 bucket_id = group_se->bucket_id;
+    u64 now = bpf_ktime_get_ns();
+
+    group_se->eligible = false;
+    bpf_spin_lock(&bucket->lock);
+    clutch_avg_add(&bucket->avg, group_se->vruntime, 1);
+    bpf_rbtree_add(&bucket->group_cfs_rq, &group_se->rb_node, clutch_group_less);
+    if (!requeue && !bucket->nr_groups++)
+        clutch_cluster_mark_bucket(cluster, bucket_id, true, now);
+    bpf_spin_unlock(&bucket->lock);
+}
+
+/* dispatch 取出的组实体不再插回 bucket 时调用（组已空、已失效或不在 map 中）。
+ * 组实体被取出期间仍计在 nr_groups 中，只有这里才把它减掉；
+ * bucket 真正变空时才清位并补满 warp 预算。
+ */
+static __always_inline void clutch_bucket_drop_group(struct cluster_ctx *cluster,
+                                                     struct bucket_ctx *bucket, u32 bucket_id)
+{
+    bpf_spin_lock(&bucket->lock);
+    if (bucket->nr_groups)
+        bucket->nr_groups--;
+    if (!bucket->nr_groups)
+        clutch_cluster_mark_bucket(cluster, bucket_id, false, 0);
+    bpf_spin_unlock(&bucket->lock);
+}
+
+/* 让一个刚变为非空的组进入 bucket 树。
+ * 组实体只在组从空变为非空时分配一次；加锁后再次确认，避免与并发入队或
+ * dispatch 重复插入。组已经在 bucket 中（或已被清空）时直接回收新节点。
+ * 组按离开 bucket 时保存的 lag 相对 bucket 当前平均 vruntime 放置（新建的组带一个基准时间片的负 lag），
+ * 空闲很久的组不会带着过小的 vruntime 回来独占 bucket，跑得过多的组也不会一直被压在后面。
+ */
+static __always_inline int clutch_group_activate(struct group_ctx *slot,
+                                                 const struct group_key *key,
+                                                 struct cluster_ctx *cluster,
+                                                 struct bucket_ctx *bucket)
+{
+    u64 avg = READ_ONCE(bucket->avg.cur);
+    struct clutch_se *group_se;
+    bool activate;
+
+    group_se = clutch_alloc_group_se(key);
+    if (!group_se)
+        return -1;
+
+    bpf_spin_lock(&slot->lock);
+    activate = !slot->queued && slot->nr_children;
+    if (activate) {
+        slot->vruntime = clutch_place_vruntime(avg, slot->lag_valid ? slot->vlag : 0);
+        slot->queued = 1;
+        slot->seq++;
+        clutch_sync_group_se(group_se, slot);
+    }
+    bpf_spin_unlock(&slot->lock);
+
+    if (!activate) {
+        clutch_se_free(group_se);
+        return 0;
+    }
+
+    clutch_bucket_add_group(cluster, bucket, group_se, false);
+    return 0;
+}
+
+/* 把线程挂入所属组的 thread_cfs_rq。
+ * 组已经在 bucket 树中时只更新组内队列；队头变化不会在 bucket 树中原地调整
+ * （BPF rbtree 无法按节点查找），组实体会在下次被选中时按新队头重新插入。
+ * cluster 的排队线程数在插入前先加一，保证并发 dispatch 的减一不会把它减成负数。
+ * 组已被回收（dead）时重新查找或创建一次，线程不会落进已删除的组。
+ * blocked_ns 是线程刚结束的睡眠时长，在同一临界区内计入组的 CPU 使用统计。
+ */
+static __always_inline int clutch_queue_thread(struct group_ctx *slot,
+                                               const struct group_key *key,
+                                               struct clutch_se *thread_se,
+                                               u64 blocked_ns)
+{
+    struct cluster_ctx *cluster;
+    struct bucket_ctx *bucket;
+    u64 now = bpf_ktime_get_ns();
+    u64 weight, vruntime;
+    bool need_activate;
+
+    cluster = clutch_cluster_ctx(key->cluster_id);
+    bucket = clutch_bucket_ctx(key->cluster_id, key->bucket_id);
+    if (!cluster || !bucket) {
+        clutch_se_free(thread_se);
+        return -1;
+    }
+
+    __sync_fetch_and_add(&cluster->nr_queued, 1);
+
+    bpf_spin_lock(&slot->lock);
+    if (slot->dead) {
+        bpf_spin_unlock(&slot->lock);
+
+        slot = clutch_group_ctx(key, thread_se->vruntime);
+        if (!slot) {
+            __sync_fetch_and_sub(&cluster->nr_queued, 1);
+            clutch_se_free(thread_se);
+            return -1;
+        }
+
+        bpf_spin_lock(&slot->lock);
+        if (slot->dead) {
+            bpf_spin_unlock(&slot->lock);
+            __sync_fetch_and_sub(&cluster->nr_queued, 1);
+            clutch_se_free(thread_se);
+            return -1;
+        }
+    }
+    thread_se->eligible = false;
+    weight = clutch_wmult_weight(thread_se->wmult);
+    vruntime = thread_se->vruntime;
+    if (bpf_rbtree_add(&slot->thread_cfs_rq, &thread_se->rb_node, clutch_thread_less)) {
+        bpf_spin_unlock(&slot->lock);
+        __sync_fetch_and_sub(&cluster->nr_queued, 1);
+        return -1;
+    }
+    clutch_avg_add(&slot->avg, vruntime, weight);
+    slot->nr_children++;
+    slot->last_active_ns = now;
+    clutch_group_account_locked(slot, 0, blocked_ns, now);
+    clutch_refresh_group_key_locked(slot);
+    need_activate = !slot->queued;
+    bpf_spin_unlock(&slot->lock);
+
+    if (!need_activate)
+        return 0;
+
+    return clutch_group_activate(slot, key, cluster, bucket);
+}
+
+/* 线程进入 slot（组 key）前把 vruntime 换算到该组的坐标系：v = V(组) - lag。
+ * 睡眠后第一次回到队列（或被空闲快路径直接派发）的线程使用睡前保存的 lag，只使用一次；
+ * lag 只在 stopping 发现线程不再可运行时保存，被抢占后重新入队的线程不会带着它。
+ * 没有保存 lag 却换了组的线程（窃取或跨 cluster 迁移后重新入队、bucket 或 cgroup 变化）
+ * 按它相对旧组平均 vruntime 的 lag 重新放置，旧组已被删除时 lag 记为 0，
+ * 不会带着另一个组里累计的绝对 vruntime 进来。留在原组的线程不做调整。
+ */
+static __always_inline void clutch_thread_place(struct thread_ctx *tctx, struct group_ctx *slot,
+                                                const struct group_key *key)
+{
+    struct group_key old = tctx->group;
+    struct group_ctx *old_slot;
+    s64 lag = 0;
+
+    if (tctx->lag_valid) {
+        lag = tctx->vlag;
+    } else if (tctx->group_valid &&
+               (old.cluster_id != key->cluster_id || old.bucket_id != key->bucket_id ||
+                old.group_id != key->group_id)) {
+        old_slot = bpf_map_lookup_elem(&group_ctx_map, &old);
+        if (old_slot)
+            lag = clutch_entity_lag(READ_ONCE(old_slot->avg.cur), tctx->vruntime,
+                                    clutch_lag_limit(old.bucket_id, tctx->wmult));
+    } else {
+        return;
+    }
+
+    tctx->vruntime = clutch_place_vruntime(READ_ONCE(slot->avg.cur), lag);
+    tctx->lag_valid = false;
+}
+
+/* 认领 seq 对应节点在 cluster 排队计数中的那一份并减掉，CAS 失败说明已被 dispatch 认领。
+ * dequeue 作废旧节点时调用；入队发现上一个节点仍未被认领时也先调用，
+ * 否则覆盖 queued_seq 后旧节点的那一份计数永远不会被减掉。
+ */
+static __always_inline void clutch_thread_release_queued(struct thread_ctx *tctx, u64 seq)
+{
+    struct cluster_ctx *cluster;
+
+    if (!seq || __sync_val_compare_and_swap(&tctx->queued_seq, seq, 0) != seq)
+        return;
+
+    cluster = clutch_cluster_ctx(tctx->group.cluster_id);
+    if (cluster)
+        __sync_fetch_and_sub(&cluster->nr_queued, 1);
+}
+
+/* 把一个任务接入 clutch 调度结构。
+ * 过程包括：获取任务私有上下文、确定 preferred cpu/cluster/bucket、找到线程槽位、
+ * 创建线程节点，并把它加入线程树和 bucket 树。
+ * 睡眠后醒来或换了组的线程按 lag 相对新组当前的平均 vruntime 放置（clutch_thread_place）。
+ * 线程换到了另一个组（cluster 迁移、bucket 或 cgroup 变化）时，旧组若已空就顺手删除。
+ */
+static __always_inline int clutch_enqueue_thread(struct task_struct *p)
+{
+    struct thread_ctx *tctx;
+    struct clutch_se *thread_se;
+    struct group_ctx *slot;
+    struct group_key key, old;
+    s32 preferred_cpu;
+    u32 cluster_id, bucket_id;
+    u64 blocked_ns = 0;
+    bool moved;
+
+    tctx = bpf_task_storage_get(&thread_ctx_map, p, 0, 0);
+    if (!tctx)
+        return -1;
+
+    preferred_cpu = clutch_pick_preferred_cpu(p);
+    cluster_id = clutch_cpu_to_cluster(preferred_cpu);
+    bucket_id = clutch_bucket_id(p, tctx);
+
+    key.cluster_id = cluster_id;
+    key.bucket_id = bucket_id;
+    key.group_id = clutch_task_group_id(p);
+
+    slot = clutch_group_ctx(&key, tctx->vruntime);
+    if (!slot)
+        return -1;
+
+    clutch_thread_place(tctx, slot, &key);
+    clutch_thread_release_queued(tctx, READ_ONCE(tctx->queued_seq));
+
+    thread_se = clutch_alloc_thread_se(p, tctx, cluster_id, bucket_id, preferred_cpu);
+    if (!thread_se)
+        return -1;
+
+    if (tctx->sleeping && tctx->last_stop_ns)
+        blocked_ns = bpf_ktime_get_ns() - tctx->last_stop_ns;
+
+    tctx->queued_seq = thread_se->seq;
+    if (clutch_queue_thread(slot, &key, thread_se, blocked_ns)) {
+        tctx->queued_seq = 0;
+        return -1;
+    }
+
+    tctx->sleeping = false;
+    old = tctx->group;
+    moved = tctx->group_valid &&
+            (old.cluster_id != key.cluster_id || old.bucket_id != key.bucket_id ||
+             old.group_id != key.group_id);
+    tctx->group = key;
+    tctx->group_valid = true;
+    tctx->queued = true;
+    if (moved)
+        clutch_group_release(&old);
+
+    clutch_kick_cluster(cluster_id, bucket_id);
+    return 0;
+}
+
+/* 取出 thread_se 对应任务的引用。
+ * 默认直接取走入队时保存在节点里的 task kptr；CLUTCH_TASK_LOOKUP_PID 模式保留
+ * 旧的按 pid 反查路径，仅用于和 kptr 路径对比 dispatch 延迟。
+ */
+static __always_inline struct task_struct *clutch_se_take_task(struct clutch_se *thread_se)
+{
+    struct task_struct *p;
+
+    if (dispatch_task_lookup == CLUTCH_TASK_LOOKUP_PID) {
+        p = bpf_task_from_pid(thread_se->pid);
+        if (p)
+            return p;
+    }
+
+    return bpf_kptr_xchg(&thread_se->task, NULL);
+}
+
+/* 把选中的线程真正 dispatch 到某个 CPU。
+ * dispatch 只负责把任务放进目标 DSQ；真正开始运行的时点由 running 回调记录。
+ * group/charge 是取出该线程时预先记到组上的 vruntime，stopping 时按实际运行时间修正。
+ * 节点 seq 与 thread_ctx 的入队序号不一致说明任务已被 dequeue，节点作废。
+ * 开启 dispatch_bench 时累计从取任务引用到完成 dispatch 的耗时。
+ */
+static __noinline int clutch_dispatch_thread(struct clutch_se *thread_se, s32 cpu,
+                                             const struct group_key *group, u64 charge)
+{
+    struct task_struct *p;
+    struct thread_ctx *tctx;
+    s32 target_cpu;
+    u64 start_ns = 0;
+
+    if (dispatch_bench)
+        start_ns = bpf_ktime_get_ns();
+
+    p = clutch_se_take_task(thread_se);
     if (!p)
         return -1;
 
-    target_cpu = clutch_pick_dispatch_cpu(p, thread_se->dispatch_cpu, cpu);
+    tctx = bpf_task_storage_get(&thread_ctx_map, p, 0, 0);
+    if (!tctx || tctx->enq_seq != thread_se->seq) {
+        bpf_task_release(p);
+        clutch_stat_inc(CLUTCH_STAT_DEQUEUE_STALE);
+        return -1;
+    }
+
+    target_cpu = clutch_pick_dispatch_cpu(p, thread_se->dispatch_cpu, cpu);
+
+    tctx->queued = false;
+    tctx->cluster_id = thread_se->cluster_id;
+    tctx->bucket_id = thread_se->bucket_id;
+    tctx->preferred_cpu = thread_se->dispatch_cpu;
+    tctx->wmult = thread_se->wmult;
+    tctx->group = *group;
+    tctx->group_charge = charge;
+    tctx->group_charged = true;
+
+    scx_bpf_dispatch(p,
+                     target_cpu < 0 ? SCX_DSQ_GLOBAL :
+                     (target_cpu == cpu ? SCX_DSQ_LOCAL : (SCX_DSQ_LOCAL_ON | target_cpu)),
+                     clutch_record_slice(thread_se->bucket_id,
+                                         thread_se->slice_ns ?: DEFAULT_SLICE_NS),
+                     0);
+
+    bpf_task_release(p);
+
+    if (dispatch_bench) {
+        clutch_stat_add(CLUTCH_STAT_DISPATCH_NS, bpf_ktime_get_ns() - start_ns);
+        clutch_stat_inc(CLUTCH_STAT_DISPATCH_SAMPLES);
+    }
+
+    clutch_se_free(thread_se);
+    return 0;
+}
+
+SEC("struct_ops/running")
+/* 任务真正开始在某个 CPU 上执行时的回调。
+ * 这里把本 CPU 的运行快照写入全局 cpu_run_state_map[cpu]，并记录运行起始时间。
+ * 跨回调的权威记账状态保存在 thread_ctx 中，避免依赖 stopping 的触发 CPU。
+ */
+void BPF_PROG(clutch_running, struct task_struct *p)
+{
+    struct cpu_run_state *acct;
+    struct thread_ctx *tctx;
+    s32 cpu;
+
+    cpu = scx_bpf_task_cpu(p);
+    if (cpu < 0 || cpu >= MAX_CPUS)
+        return;
+
+    acct = bpf_map_lookup_elem(&cpu_run_state_map, &cpu);
+    tctx = bpf_task_storage_get(&thread_ctx_map, p, 0, 0);
+    if (!acct || !tctx)
+        return;
+
+    acct->wmult = tctx->wmult;
+    acct->cluster_id = tctx->cluster_id;
+    acct->bucket_id = tctx->bucket_id;
+    acct->pid = p->pid;
+    acct->tgid = p->tgid;
+    acct->run_cpu = cpu;
+    acct->valid = 1;
+    acct->preempt_pending = 0;
+
+    tctx->last_run_ns = bpf_ktime_get_ns();
+    tctx->run_start_ns = tctx->last_run_ns;
+    tctx->run_delta_v = 0;
+    tctx->run_cpu = cpu;
+    tctx->is_running = true;
+}
+
+/* 从 bucket 中取出当前最应该运行的组：默认是最小 vruntime 的组，
+ * --eevdf 模式下是 eligible 组中虚拟 deadline 最早者（clutch_eevdf_pop_locked）。
+ * 同时从 bucket 的平均 vruntime 中扣除该组。
+ * 取出的组实体仍计在 nr_groups 中、位图也不清位：组内还有线程时它马上会被插回，
+ * 只有一个忙碌组的 bucket 不能因此每次派发都“变空”，从而补满 warp 并重设 deadline。
+ * 调用方不再插回时用 clutch_bucket_drop_group() 减掉。树为空时（组实体都在其它 CPU 手上）返回 NULL。
+ */
+static __always_inline struct clutch_se *
+clutch_pop_group_from_bucket(struct bucket_ctx *bucket)
+{
+    struct clutch_se *group_se = NULL;
+    struct bpf_rb_node *rb;
+
+    bpf_spin_lock(&bucket->lock);
+    rb = clutch_eevdf_pop_locked(&bucket->group_eligible_rq, &bucket->group_cfs_rq,
+                                 clutch_avg_vruntime(&bucket->avg), true);
+    if (rb) {
+        group_se = container_of(rb, struct clutch_se, rb_node);
+        clutch_avg_sub(&bucket->avg, group_se->vruntime, 1);
+    }
+    bpf_spin_unlock(&bucket->lock);
+
+    return group_se;
+}
+
+/* 在 cluster 内按 bucket 绝对 deadline（及 warp）选择下一个 bucket，全程不加锁。
+ * 只读位图与 deadline，不推进 deadline；真正派发出线程后由 clutch_bucket_selected() 重设。
+ */
+static __always_inline s32 clutch_pick_bucket_id(struct cluster_ctx *cluster, bool *warped)
+{
+    u32 mask = (u32)READ_ONCE(cluster->bucket_mask);
+
+    *warped = false;
+    if (!mask)
+        return -1;
+
+    return clutch_select_bucket(cluster, mask, warped);
+}
+
+/* 在 cluster 内选择下一个组。
+ * 顶层 bucket 先按绝对 deadline 执行 EDF 选桶，再从选中的 bucket 弹出 group。
+ * 是否靠 warp 选中通过 warped 返回，由调用方决定何时调用 clutch_bucket_selected()。
+ */
+static __always_inline struct clutch_se *
+clutch_pick_group(struct cluster_ctx *cluster, u32 cluster_id, bool *warped)
+{
+    struct bucket_ctx *bucket;
+    s32 bucket_id;
+
+    bucket_id = clutch_pick_bucket_id(cluster, warped);
+    if (bucket_id < 0)
+        return NULL;
+
+    bucket = clutch_bucket_ctx(cluster_id, (u32)bucket_id);
+    if (!bucket)
+        return NULL;
+
+    return clutch_pop_group_from_bucket(bucket);
+}
+
+/* 每个 CPU 一个绑定队列，仿照 XNU 的 bound run queue，两种引擎都使用。 */
+static __always_inline u64 clutch_bound_dsq_id(s32 cpu)
+{
+    return CLUTCH_BOUND_DSQ_BASE + (u64)cpu;
+}
+
+/* DSQ 引擎下 cluster 的非空 bucket 位图，对应红黑树引擎的 cluster->bucket_mask。 */
+static __always_inline u32 clutch_dsq_bucket_mask(u32 cluster_id)
+{
+    u32 nr_buckets = clutch_nr_buckets();
+    u32 mask = 0, i;
+
+    for (i = 0; i < MAX_CLUTCH_BUCKETS && i < nr_buckets; i++) {
+        if (scx_bpf_dsq_nr_queued(clutch_bucket_dsq_id(cluster_id, i)) > 0)
+            mask |= 1U << i;
+    }
+
+    return mask;
+}
+
+/* 只能在一个 CPU 上运行的任务（per-CPU kthread、被绑核的线程）直接进入该 CPU 的
+ * 绑定队列，不经过 cluster 的共享红黑树和锁，也不参与 cluster 级 EDF。
+ * 按 vruntime 排序，入队后唤醒可能空闲的目标 CPU。
+ */
+static __always_inline int clutch_bound_enqueue(struct task_struct *p, u64 enq_flags)
+{
+    struct thread_ctx *tctx;
+    u32 cluster_id, bucket_id;
+    s32 cpu;
+
+    cpu = (s32)bpf_cpumask_first(p->cpus_ptr);
+    if (cpu < 0 || cpu >= (s32)clutch_nr_cpus())
+        return -1;
+
+    tctx = bpf_task_storage_get(&thread_ctx_map, p, 0, 0);
+    if (!tctx)
+        return -1;
+
+    cluster_id = clutch_cpu_to_cluster(cpu);
+    bucket_id = clutch_bucket_id(p, tctx);
+    clutch_update_thread_ctx(p, tctx, cluster_id, bucket_id, cpu);
+    scx_bpf_dispatch_vtime(p, clutch_bound_dsq_id(cpu),
+                           clutch_record_slice(bucket_id,
+                                               clutch_calculate_slice(cluster_id, bucket_id)),
+                           tctx->vruntime, enq_flags);
+    scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
+    clutch_stat_inc(CLUTCH_STAT_BOUND_ENQUEUE);
+    return 0;
+}
+
+/* DSQ 引擎入队：按线程 vruntime 插入所属 cluster/bucket 的 vtime DSQ。 */
+static __always_inline int clutch_dsq_enqueue(struct task_struct *p, u64 enq_flags)
+{
+    struct cluster_ctx *cluster;
+    struct thread_ctx *tctx;
+    s32 preferred_cpu;
+    u32 cluster_id, bucket_id;
+    u64 slice_ns, dsq_id;
 
     tctx = bpf_task_storage_get(&thread_ctx_map, p, 0, 0);
+    if (!tctx)
+        return -1;
 
-    if (tctx) {
-        tctx->cluster_id = thread_se->cluster_id;
-        tctx->bucket_id = thread_se->bucket_id;
-        tctx->preferred_cpu = thread_se->dispatch_cpu;
-        tctx->wmult = thread_se->wmult;
-    }
+    preferred_cpu = clutch_pick_preferred_cpu(p);
+    cluster_id = clutch_cpu_to_cluster(preferred_cpu);
+    bucket_id = clutch_bucket_id(p, tctx);
+    slice_ns = clutch_calculate_slice(cluster_id, bucket_id);
+    clutch_update_thread_ctx(p, tctx, cluster_id, bucket_id, preferred_cpu);
 
-    scx_bpf_dispatch(p,
-                     target_cpu < 0 ? SCX_DSQ_GLOBAL :
-                     (target_cpu == cpu ? SCX_DSQ_LOCAL : (SCX_DSQ_LOCAL_ON | target_cpu)),
-                     thread_se->slice_ns ?: DEFAULT_SLICE_NS,
-                     0);
+    dsq_id = clutch_bucket_dsq_id(cluster_id, bucket_id);
+    cluster = clutch_cluster_ctx(cluster_id);
+    if (cluster && !scx_bpf_dsq_nr_queued(dsq_id))
+        clutch_bucket_arm_deadline(cluster, bucket_id, bpf_ktime_get_ns());
 
-    bpf_task_release(p);
-    bpf_obj_drop(thread_se);
+    scx_bpf_dispatch_vtime(p, dsq_id, clutch_record_slice(bucket_id, slice_ns),
+                           tctx->vruntime, enq_flags);
+    clutch_kick_cluster(cluster_id, bucket_id);
     return 0;
 }
 
-SEC("struct_ops/running")
-/* 任务真正开始在某个 CPU 上执行时的回调。
- * 这里把本 CPU 的本地运行快照写入 percpu map，并记录运行起始时间。
- * 跨回调的权威记账状态保存在 thread_ctx 中，避免依赖 stopping 的触发 CPU。
+/* DSQ 引擎派发：先读各 bucket DSQ 的长度得到非空位图，再按 EDF（及 warp）顺序逐个尝试 consume。
+ * consume 后 bucket DSQ 变空时补满它的 warp 预算，对应红黑树引擎清位时的处理。
  */
-void BPF_PROG(clutch_running, struct task_struct *p)
+static __always_inline int clutch_dsq_dispatch(u32 cluster_id)
 {
-    struct cpu_run_state *acct;
+    struct cluster_ctx *cluster = clutch_cluster_ctx(cluster_id);
+    u32 mask = clutch_dsq_bucket_mask(cluster_id);
+    u32 i;
+
+    if (!cluster)
+        return -ENOENT;
+
+    for (i = 0; i < MAX_CLUTCH_BUCKETS && mask; i++) {
+        bool warped;
+        s32 bucket_id = clutch_select_bucket(cluster, mask, &warped);
+        u64 dsq_id;
+
+        if (bucket_id < 0)
+            break;
+
+        dsq_id = clutch_bucket_dsq_id(cluster_id, (u32)bucket_id);
+        if (scx_bpf_consume(dsq_id)) {
+            clutch_bucket_selected(cluster, (u32)bucket_id, warped);
+            if (!scx_bpf_dsq_nr_queued(dsq_id))
+                clutch_bucket_refill_warp(cluster, (u32)bucket_id);
+            return 0;
+        }
+
+        mask &= ~(1U << bucket_id);
+    }
+
+    return -ENOENT;
+}
+
+/* 判断 cluster 当前是否没有任何排队工作。
+ * rbtree 引擎直接读非空 bucket 位图；DSQ 引擎逐个检查 bucket DSQ 的长度。
+ */
+static __always_inline bool clutch_cluster_idle(u32 cluster_id)
+{
+    struct cluster_ctx *cluster;
+
+    if (clutch_engine == CLUTCH_ENGINE_DSQ)
+        return !clutch_dsq_bucket_mask(cluster_id);
+
+    cluster = clutch_cluster_ctx(cluster_id);
+    return cluster && !READ_ONCE(cluster->bucket_mask);
+}
+
+/* 唤醒快路径：目标 CPU 空闲且所在 cluster 没有排队工作时，
+ * 直接把任务放进该 CPU 的本地 DSQ，跳过 cluster -> bucket -> group -> thread 的插入与弹出。
+ * 睡眠醒来的线程同样先按保存的 lag 相对原来所在组放置。
+ * 成功返回 true，此后 sched_ext 不会再为该任务调用 enqueue。
+ */
+static __always_inline bool clutch_idle_direct_dispatch(struct task_struct *p, s32 cpu)
+{
+    struct group_ctx *slot;
     struct thread_ctx *tctx;
-    u32 key = CPU_RUN_STATE_KEY;
+    u32 cluster_id, bucket_id;
+
+    if (cpu < 0 || cpu >= (s32)clutch_nr_cpus())
+        return false;
+
+    cluster_id = clutch_cpu_to_cluster(cpu);
+    if (!clutch_cluster_idle(cluster_id))
+        return false;
+
+    tctx = bpf_task_storage_get(&thread_ctx_map, p, 0, 0);
+    if (!tctx)
+        return false;
+
+    if (tctx->group_valid && clutch_engine == CLUTCH_ENGINE_RBTREE) {
+        struct group_key key = tctx->group;
+
+        slot = bpf_map_lookup_elem(&group_ctx_map, &key);
+        if (slot)
+            clutch_thread_place(tctx, slot, &key);
+    }
+
+    bucket_id = clutch_bucket_id(p, tctx);
+    clutch_update_thread_ctx(p, tctx, cluster_id, bucket_id, cpu);
+    scx_bpf_dispatch(p, SCX_DSQ_LOCAL,
+                     clutch_record_slice(bucket_id, clutch_calculate_slice(cluster_id, bucket_id)),
+                     0);
+    return true;
+}
+
+/* 为 fork 出的新任务选核：在允许运行的 cluster 中挑排队线程数 / CPU 数最小的一个，
+ * 优先占用其中的空闲 CPU，没有空闲 CPU 时返回该 cluster 内第一个允许的 CPU。
+ * 子任务因此不会默认堆在父任务所在的 cluster 上。没有可用 cluster 时返回 -1。
+ */
+static __always_inline s32 clutch_fork_select_cpu(struct task_struct *p, bool *is_idle)
+{
+    struct cluster_ctx *cluster;
+    struct cluster_cpus *cc;
+    struct bpf_cpumask *mask;
+    u64 load, best_load = 0, best_nr = 1;
+    s32 best = -1, fallback = -1;
+    bool allowed;
+    int i;
+
+    *is_idle = false;
+
+    bpf_for(i, 0, clutch_nr_clusters) {
+        u32 cid = (u32)i;
+
+        cc = bpf_map_lookup_elem(&cluster_cpus_map, &cid);
+        cluster = clutch_cluster_ctx(cid);
+        if (!cc || !cc->nr || !cluster)
+            continue;
+
+        bpf_rcu_read_lock();
+        mask = cluster->cpumask;
+        allowed = mask && bpf_cpumask_intersects(cast_mask(mask), p->cpus_ptr);
+        bpf_rcu_read_unlock();
+        if (!allowed)
+            continue;
+
+        load = clutch_cluster_load(cid);
+        if (best < 0 || load * best_nr < best_load * cc->nr) {
+            best = i;
+            best_load = load;
+            best_nr = cc->nr;
+        }
+    }
+
+    if (best < 0)
+        return -1;
+
+    cc = bpf_map_lookup_elem(&cluster_cpus_map, &best);
+    if (!cc)
+        return -1;
+
+    bpf_for(i, 0, CLUTCH_MAX_CLUSTER_CPUS) {
+        s32 cpu;
+
+        if ((u32)i >= cc->nr)
+            break;
+
+        cpu = cc->cpus[i];
+        if (!bpf_cpumask_test_cpu(cpu, p->cpus_ptr))
+            continue;
+        if (scx_bpf_test_and_clear_cpu_idle(cpu)) {
+            *is_idle = true;
+            return cpu;
+        }
+        if (fallback < 0)
+            fallback = cpu;
+    }
+
+    return fallback;
+}
+
+SEC("struct_ops/select_cpu")
+/* 任务唤醒时的 CPU 选择回调。
+ * fork 出的新任务（SCX_WAKE_FORK）放到负载最轻的 cluster；其余任务复用 sched_ext
+ * 默认实现选核。若选中的 CPU 空闲且其 cluster 没有排队工作，则走直接派发快路径；
+ * fork 路径占用了空闲 CPU 却没能直接派发时唤醒它，避免它在任务入队后继续空闲。
+ */
+s32 BPF_PROG(clutch_select_cpu, struct task_struct *p, s32 prev_cpu, u64 wake_flags)
+{
+    bool is_idle = false;
     s32 cpu;
 
-    cpu = scx_bpf_task_cpu(p);
-    if (cpu < 0 || cpu >= MAX_CPUS)
+    clutch_stat_inc(CLUTCH_STAT_SELECT_CPU);
+
+    if (wake_flags & SCX_WAKE_FORK) {
+        cpu = clutch_fork_select_cpu(p, &is_idle);
+        if (cpu >= 0) {
+            clutch_stat_inc(CLUTCH_STAT_FORK_PLACE);
+            if (is_idle) {
+                if (clutch_idle_direct_dispatch(p, cpu)) {
+                    clutch_stat_inc(CLUTCH_STAT_IDLE_DIRECT);
+                } else {
+                    scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
+                    clutch_stat_inc(CLUTCH_STAT_KICK_IDLE);
+                }
+            }
+            return cpu;
+        }
+    }
+
+    cpu = scx_bpf_select_cpu_dfl(p, prev_cpu, wake_flags, &is_idle);
+
+    if (is_idle && clutch_idle_direct_dispatch(p, cpu))
+        clutch_stat_inc(CLUTCH_STAT_IDLE_DIRECT);
+
+    return cpu;
+}
+
+SEC("struct_ops/enqueue")
+/* 任务入队入口。
+ * 只允许在单个 CPU 上运行的任务进入该 CPU 的绑定队列；其余任务按所选引擎进入
+ * clutch 的线程层次结构或 bucket DSQ；如果失败，再回退到全局 DSQ。
+ */
+int BPF_PROG(clutch_enqueue, struct task_struct *p, u64 enq_flags)
+{
+    int ret;
+
+    if (p->nr_cpus_allowed == 1 && !clutch_bound_enqueue(p, enq_flags))
+        return 0;
+
+    if (clutch_engine == CLUTCH_ENGINE_DSQ)
+        ret = clutch_dsq_enqueue(p, enq_flags);
+    else
+        ret = clutch_enqueue_thread(p);
+
+    if (ret)
+        scx_bpf_dispatch(p, SCX_DSQ_GLOBAL, clutch_task_slice(p), enq_flags);
+
+    return 0;
+}
+
+/* 撤销取出线程时预记到组上的 vruntime（线程最终没有被派发）。 */
+static __always_inline void clutch_group_uncharge(struct group_ctx *slot, u64 charge)
+{
+    bpf_spin_lock(&slot->lock);
+    slot->vruntime = slot->vruntime > charge ? slot->vruntime - charge : 0;
+    bpf_spin_unlock(&slot->lock);
+}
+
+/* stopping 时按实际运行折算的 vruntime 修正 dispatch 时预记到组上的值，
+ * 并在同一临界区内把本次运行时间计入组的 CPU 使用统计。
+ * 组已经不存在时直接放弃，组级记账只影响后续排序。
+ */
+static __always_inline void clutch_group_settle(struct thread_ctx *tctx, u64 delta_v,
+                                                u64 used_ns, u64 now)
+{
+    struct group_ctx *slot;
+    struct group_key key = tctx->group;
+    u64 charge = tctx->group_charge;
+
+    tctx->group_charged = false;
+
+    slot = bpf_map_lookup_elem(&group_ctx_map, &key);
+    if (!slot)
         return;
 
-    acct = bpf_map_lookup_elem(&cpu_run_state_map, &key);
-    tctx = bpf_task_storage_get(&thread_ctx_map, p, 0, 0);
-    if (!acct || !tctx)
+    bpf_spin_lock(&slot->lock);
+    if (delta_v >= charge)
+        slot->vruntime += delta_v - charge;
+    else
+        slot->vruntime = slot->vruntime > charge - delta_v ?
+                         slot->vruntime - (charge - delta_v) : 0;
+    clutch_group_account_locked(slot, used_ns, 0, now);
+    bpf_spin_unlock(&slot->lock);
+}
+
+/* 线程不是从组里派发的（例如 select_cpu 直接派发）时，只把运行时间计入它最近所在的组。 */
+static __always_inline void clutch_group_account(const struct group_key *key, u64 used_ns,
+                                                 u64 now)
+{
+    struct group_ctx *slot;
+
+    slot = bpf_map_lookup_elem(&group_ctx_map, key);
+    if (!slot)
         return;
 
-    acct->wmult = tctx->wmult;
-    acct->cluster_id = tctx->cluster_id;
-    acct->bucket_id = tctx->bucket_id;
-    acct->pid = p->pid;
-    acct->tgid = p->tgid;
-    acct->run_cpu = cpu;
-    acct->valid = 1;
+    bpf_spin_lock(&slot->lock);
+    clutch_group_account_locked(slot, used_ns, 0, now);
+    bpf_spin_unlock(&slot->lock);
+}
 
-    tctx->last_run_ns = bpf_ktime_get_ns();
-    tctx->run_cpu = cpu;
-    tctx->is_running = true;
+/* 判断从其它 cluster 窃取来的线程能否在 cpu 上运行。
+ * 线程刚停止运行不久（不超过 steal_migration_cost_ns）时认为它在原 cluster
+ * 的缓存仍是热的，迁移代价高于等待；另外必须满足任务自身的 cpumask。
+ */
+static __always_inline bool clutch_can_steal(struct clutch_se *thread_se, s32 cpu)
+{
+    struct task_struct *p;
+    bool allowed = false;
+
+    if (steal_migration_cost_ns && thread_se->stop_ns &&
+        bpf_ktime_get_ns() - thread_se->stop_ns < steal_migration_cost_ns) {
+        clutch_stat_inc(CLUTCH_STAT_STEAL_HOT);
+        return false;
+    }
+
+    bpf_rcu_read_lock();
+    p = thread_se->task;
+    if (p)
+        allowed = bpf_cpumask_test_cpu(cpu, p->cpus_ptr);
+    bpf_rcu_read_unlock();
+
+    if (!allowed)
+        clutch_stat_inc(CLUTCH_STAT_STEAL_AFFINITY);
+
+    return allowed;
 }
 
-/* 从 bucket 中取出当前最应该运行的组，也就是红黑树最左侧节点。 */
-static __always_inline struct clutch_se *
-clutch_pop_group_from_bucket(struct bucket_ctx *bucket)
+/* 认领刚从组内取出的线程节点在 cluster 排队计数中的那一份。
+ * thread_ctx 的 queued_seq 记录仍计入 nr_queued 的节点序号，dispatch 与 dequeue
+ * 用 CAS 把它清零，谁成功谁减计数，同一节点只减一次。
+ * 认领失败说明节点已被 dequeue 作废（计数已在 dequeue 时减掉）。
+ */
+static __always_inline bool clutch_thread_se_claim(struct clutch_se *thread_se)
+{
+    struct thread_ctx *tctx = NULL;
+    struct task_struct *p;
+    u64 seq = thread_se->seq;
+    bool claimed = false;
+
+    bpf_rcu_read_lock();
+    p = thread_se->task;
+    if (p)
+        tctx = bpf_task_storage_get(&thread_ctx_map, p, 0, 0);
+    if (tctx)
+        claimed = __sync_val_compare_and_swap(&tctx->queued_seq, seq, 0) == seq;
+    bpf_rcu_read_unlock();
+
+    return claimed;
+}
+
+/* 窃取被拒绝后把线程放回所属组，并重新计入排队计数。
+ * 放回失败时（组已失效且无法重建、map 已满或插入红黑树失败）thread_se 已被回收，
+ * 任务改派到全局 DSQ，与 enqueue 的回退一致，不会留在 BPF 侧无人派发。
+ * 节点在此期间已被 dequeue 作废时直接回收，不再放回。
+ */
+static __always_inline void clutch_steal_requeue(struct group_ctx *slot,
+                                                 const struct group_key *key,
+                                                 struct clutch_se *thread_se)
+{
+    struct task_struct *p, *ref = NULL;
+    struct thread_ctx *tctx;
+    u64 seq = thread_se->seq;
+
+    bpf_rcu_read_lock();
+    p = thread_se->task;
+    if (p)
+        ref = bpf_task_acquire(p);
+    bpf_rcu_read_unlock();
+
+    if (!ref) {
+        clutch_se_free(thread_se);
+        return;
+    }
+
+    tctx = bpf_task_storage_get(&thread_ctx_map, ref, 0, 0);
+    if (!tctx || tctx->enq_seq != seq) {
+        clutch_se_free(thread_se);
+        bpf_task_release(ref);
+        return;
+    }
+
+    tctx->queued_seq = seq;
+    if (clutch_queue_thread(slot, key, thread_se, 0)) {
+        tctx->queued_seq = 0;
+        tctx->queued = false;
+        scx_bpf_dispatch(ref, SCX_DSQ_GLOBAL, clutch_task_slice(ref), 0);
+    }
+    bpf_task_release(ref);
+}
+
+/* 从选中的组实体出发取出一个线程并 dispatch。
+ * 取锁前按 cluster 当前负载为线程算出时间片（clutch_calculate_slice），
+ * 取出线程时先按这个时间片给组预记 vruntime，组实体带着推进后的 vruntime
+ * 重新插回 bucket，这样多线程组不会在其线程真正运行之前连续占据 bucket 队头；
+ * 组变空时才回收组实体，并通过 clutch_bucket_drop_group() 把它从 bucket 的组数中减掉。
+ * steal 为真时 cluster 是被窃取的其它 cluster：线程不满足 clutch_can_steal()
+ * 就原样放回所属组并返回 -EBUSY，否则改挂到本 CPU 所在 cluster 后派发到本地。
+ * bucket 的 deadline、warp 窗口与选中统计只在线程真正派发出去后才更新，
+ * 空组、失效节点与被拒绝的窃取都不会推迟 bucket 的 deadline。
+ * 返回 0 表示已 dispatch，-EAGAIN 表示遇到空组或失效组、可以继续尝试下一个组，
+ * -ESTALE 表示取到的是已被 dequeue 作废的节点，-ENOENT 表示 cluster 内已无可选的组。
+ */
+static __always_inline int clutch_dispatch_group(struct cluster_ctx *cluster,
+                                                 u32 cluster_id, s32 cpu, bool steal)
 {
+    struct clutch_se *group_se;
+    struct clutch_se *thread_se;
+    struct bucket_ctx *bucket;
+    struct group_ctx *slot;
     struct bpf_rb_node *rb;
+    struct group_key key;
+    bool requeue;
+    u64 charge, now, slice_ns, bucket_avg;
+    s64 lag_limit;
+    bool warped;
 
-    if (!bucket)
-        return NULL;
+    group_se = clutch_pick_group(cluster, cluster_id, &warped);
+    if (!group_se)
+        return READ_ONCE(cluster->bucket_mask) ? -EAGAIN : -ENOENT;
 
-    bpf_spin_lock(&bucket->lock);
-    rb = bpf_rbtree_first(&bucket->group_cfs_rq);
-    if (rb) {
-        rb = bpf_rbtree_remove(&bucket->group_cfs_rq, rb);
-        if (rb) {
-            struct clutch_se *group_se;
-
-            group_se = container_of(rb, struct clutch_se, rb_node);
-            if (bucket->nr_groups)
-                bucket->nr_groups--;
-            bpf_spin_unlock(&bucket->lock);
-            return group_se;
+    key.cluster_id = group_se->cluster_id;
+    key.bucket_id = group_se->bucket_id;
+    key.group_id = (u32)group_se->pid;
+    bucket = clutch_bucket_ctx(key.cluster_id, key.bucket_id);
+    slot = bpf_map_lookup_elem(&group_ctx_map, &key);
+    if (!slot) {
+        clutch_se_free(group_se);
+        if (bucket)
+            clutch_bucket_drop_group(cluster, bucket, key.bucket_id);
+        return -EAGAIN;
+    }
+
+    bucket_avg = bucket ? READ_ONCE(bucket->avg.cur) : 0;
+    lag_limit = clutch_lag_limit(key.bucket_id, clutch_prio_to_wmult[20]);
+    slice_ns = clutch_calculate_slice(key.cluster_id, key.bucket_id);
+    now = bpf_ktime_get_ns();
+    bpf_spin_lock(&slot->lock);
+    rb = clutch_eevdf_pop_locked(&slot->thread_eligible_rq, &slot->thread_cfs_rq,
+                                 clutch_avg_vruntime(&slot->avg), false);
+    if (!rb) {
+        slot->nr_children = 0;
+        slot->queued = 0;
+        slot->vlag = clutch_entity_lag(bucket_avg, slot->vruntime, lag_limit);
+        slot->lag_valid = true;
+        bpf_spin_unlock(&slot->lock);
+        clutch_se_free(group_se);
+        if (bucket)
+            clutch_bucket_drop_group(cluster, bucket, key.bucket_id);
+        return -EAGAIN;
+    }
+
+    thread_se = container_of(rb, struct clutch_se, rb_node);
+    clutch_avg_sub(&slot->avg, thread_se->vruntime, clutch_wmult_weight(thread_se->wmult));
+    if (slot->nr_children)
+        slot->nr_children--;
+
+    thread_se->slice_ns = slice_ns;
+    charge = clutch_scale_delta(slice_ns, thread_se->wmult);
+    slot->vruntime += charge;
+    slot->last_active_ns = now;
+
+    requeue = clutch_refresh_group_key_locked(slot);
+    if (requeue) {
+        slot->seq++;
+        clutch_sync_group_se(group_se, slot);
+    } else {
+        slot->nr_children = 0;
+        slot->queued = 0;
+        slot->vlag = clutch_entity_lag(bucket_avg, slot->vruntime, lag_limit);
+        slot->lag_valid = true;
+    }
+    bpf_spin_unlock(&slot->lock);
+
+    if (requeue && bucket) {
+        clutch_bucket_add_group(cluster, bucket, group_se, true);
+    } else {
+        clutch_se_free(group_se);
+        if (bucket)
+            clutch_bucket_drop_group(cluster, bucket, key.bucket_id);
+    }
+
+    if (!clutch_thread_se_claim(thread_se)) {
+        clutch_group_uncharge(slot, charge);
+        clutch_se_free(thread_se);
+        clutch_stat_inc(CLUTCH_STAT_DEQUEUE_STALE);
+        return -ESTALE;
+    }
+    __sync_fetch_and_sub(&cluster->nr_queued, 1);
+
+    if (steal) {
+        if (!clutch_can_steal(thread_se, cpu)) {
+            clutch_group_uncharge(slot, charge);
+            clutch_steal_requeue(slot, &key, thread_se);
+            return -EBUSY;
         }
+
+        thread_se->cluster_id = clutch_cpu_to_cluster(cpu);
+        thread_se->dispatch_cpu = cpu;
+    }
+
+    if (clutch_dispatch_thread(thread_se, cpu, &key, charge)) {
+        clutch_group_uncharge(slot, charge);
+        clutch_se_free(thread_se);
+        return -ESTALE;
     }
-    bpf_spin_unlock(&bucket->lock);
 
-    return NULL;
+    clutch_bucket_selected(cluster, key.bucket_id, warped);
+    return 0;
 }
 
-/* 检查 bucket 当前是否非空。
- * 这里只做短临界区探测，真正取元素仍由 pop 路径负责。
+/* 计算本次 dispatch 最多派发多少个线程：不超过用户态配置的批量，
+ * 也不超过当前 dispatch 缓冲区剩余的槽位数。
  */
-static __always_inline bool clutch_bucket_has_groups(struct bucket_ctx *bucket)
+static __always_inline u32 clutch_dispatch_batch(void)
 {
-    bool has_groups = false;
+    u32 nr = dispatch_batch;
+    u32 slots;
 
-    if (!bucket)
-        return false;
+    if (!nr)
+        nr = 1;
+    if (nr > CLUTCH_MAX_DISPATCH_BATCH)
+        nr = CLUTCH_MAX_DISPATCH_BATCH;
 
-    bpf_spin_lock(&bucket->lock);
-    has_groups = bucket->nr_groups > 0;
-    bpf_spin_unlock(&bucket->lock);
+    slots = scx_bpf_dispatch_nr_slots();
+    if (nr > slots)
+        nr = slots;
 
-    return has_groups;
+    return nr;
 }
 
-/* 在 cluster 内按 bucket deadline 选择下一个 bucket。
- * 多个 bucket 的 deadline 相同时，从 cursor 开始顺序扫描打散热点。
+/* 用“两次随机选择取较重者”挑一个被窃取的 cluster，避免所有空闲 CPU 同时扑向
+ * 同一个最重的 cluster，也不必扫描全部 cluster。
+ * 滞后阈值：对方排队数至少比本 cluster 多 steal_imbalance 才窃取，
+ * 对方自己的 CPU 马上就能消化的少量积压不值得跨 cluster 搬运。
  */
-static __always_inline s32 clutch_pick_bucket_id(struct cluster_ctx *cluster, u32 cluster_id)
+static __always_inline s32 clutch_pick_victim(u32 cluster_id)
 {
-    u32 nr_buckets = clutch_nr_buckets();
-    u32 start, off;
-    s32 best_bucket = -1;
-    u64 best_ddl = 0;
+    u32 nr = clutch_nr_clusters;
+    u64 load_a, load_b;
+    u32 a, b;
 
-    bpf_spin_lock(&cluster->lock);
-    start = cluster->next_bucket % nr_buckets;
-    cluster->next_bucket = (start + 1) % nr_buckets;
-    bpf_spin_unlock(&cluster->lock);
-
-    for (off = 0; off < nr_buckets; off++) {
-        struct bucket_ctx *bucket;
-        u32 bucket_id = (start + off) % nr_buckets;
-        u64 ddl;
-
-        bucket = clutch_bucket_ctx(cluster_id, bucket_id);
-        if (!clutch_bucket_has_groups(bucket))
-            continue;
+    if (!steal_imbalance || nr <= 1 || nr > MAX_CLUSTERS)
+        return -1;
 
-        ddl = clutch_bucket_deadline_ns(bucket_id);
-        if (best_bucket < 0 || ddl < best_ddl) {
-            best_bucket = (s32)bucket_id;
-            best_ddl = ddl;
-        }
+    a = bpf_get_prandom_u32() % nr;
+    if (a == cluster_id)
+        a = (a + 1) % nr;
+    b = bpf_get_prandom_u32() % nr;
+    if (b == cluster_id)
+        b = (b + 1) % nr;
+
+    load_a = clutch_cluster_load(a);
+    load_b = clutch_cluster_load(b);
+    if (load_b > load_a) {
+        a = b;
+        load_a = load_b;
     }
 
-    return best_bucket;
-}
-
-/* 在 cluster 内选择下一个组。
- * 顶层 bucket 先按配置的 DDL 执行 EDF 选桶，再从选中的 bucket 弹出 group。
- */
-static __always_inline struct clutch_se *
-clutch_pick_group(struct cluster_ctx *cluster, u32 cluster_id)
-{
-    struct bucket_ctx *bucket;
-    s32 bucket_id;
-
-    bucket_id = clutch_pick_bucket_id(cluster, cluster_id);
-    if (bucket_id < 0)
-        return NULL;
+    if (load_a < clutch_cluster_load(cluster_id) + steal_imbalance)
+        return -1;
 
-    bucket = clutch_bucket_ctx(cluster_id, (u32)bucket_id);
-    return clutch_pop_group_from_bucket(bucket);
+    return (s32)a;
 }
 
-SEC("struct_ops/select_cpu")
-/* 任务唤醒时的 CPU 选择回调。
- * 当前直接复用 sched_ext 默认实现，不在这里做自定义负载均衡。
+/* 本 cluster 无事可做时，从被窃取 cluster 的 EDF bucket 取一个线程到本 CPU。
+ * 每次 dispatch 只尝试一次，被拒绝（缓存仍热或 cpumask 不允许）就放弃，
+ * 不在同一次回调里反复搬动。DSQ 引擎下 consume 本身会跳过不能在本 CPU
+ * 运行的任务，但拿不到单个任务的停止时间，不做缓存热度判断。
  */
-s32 BPF_PROG(clutch_select_cpu, struct task_struct *p, s32 prev_cpu, u64 wake_flags)
+static __always_inline bool clutch_steal(u32 cluster_id, s32 cpu)
 {
-    bool is_idle = false;
+    struct cluster_ctx *victim;
+    s32 victim_id;
 
-    return scx_bpf_select_cpu_dfl(p, prev_cpu, wake_flags, &is_idle);
-}
+    victim_id = clutch_pick_victim(cluster_id);
+    if (victim_id < 0)
+        return false;
 
-SEC("struct_ops/enqueue")
-/* 任务入队入口。
- * 优先尝试进入 clutch 的线程层次结构；如果失败，再回退到全局 DSQ。
- */
-int BPF_PROG(clutch_enqueue, struct task_struct *p, u64 enq_flags)
-{
-    if (clutch_enqueue_thread(p))
-        scx_bpf_dispatch(p, SCX_DSQ_GLOBAL, clutch_calculate_slice(p), enq_flags);
+    if (clutch_engine == CLUTCH_ENGINE_DSQ) {
+        if (clutch_dsq_dispatch((u32)victim_id))
+            return false;
+    } else {
+        victim = clutch_cluster_ctx((u32)victim_id);
+        if (!victim || clutch_dispatch_group(victim, (u32)victim_id, cpu, true))
+            return false;
+    }
 
-    return 0;
+    clutch_stat_inc(CLUTCH_STAT_STEAL);
+    return true;
 }
 
 SEC("struct_ops/dispatch")
 /* 某个 CPU 需要新任务时的派发入口。
- * 流程是：先按 cluster 取一个线程令牌，再从槽位内取最小 vruntime 的线程，
- * 最后把线程 dispatch 出去。
+ * 本 CPU 的绑定队列优先：有绑核任务时直接取一个，不再访问 cluster 结构。
+ * 流程是：先按 cluster 取一个组实体，再从组内取一个线程（最小 vruntime 或 EEVDF），
+ * 最后把线程 dispatch 出去。批量模式下在同一次回调里重复这一过程，
+ * 最多派发 clutch_dispatch_batch() 个线程，避免 CPU 每取一个任务都重新进入回调。
+ * 遇到空组时继续尝试下一个组，累计 CLUTCH_DISPATCH_RETRIES 次落空后停止；
+ * 丢弃已被 dequeue 作废的节点不算落空，另有 CLUTCH_DISPATCH_STALE_MAX 次额度；
+ * 一个线程都没有派发出去时先尝试从其它 cluster 窃取，仍失败才回退到全局 DSQ。
  */
 int BPF_PROG(clutch_dispatch, s32 cpu, struct task_struct *prev)
 {
     struct cluster_ctx *cluster;
-    struct clutch_se *group_se;
-    struct group_ctx *slot;
-    struct clutch_se *thread_se;
-    struct bpf_rb_node *rb;
-    struct group_key key;
-    u32 cluster_id;
+    u32 cluster_id, nr_batch;
+    u32 nr_dispatched = 0, nr_misses = 0;
+    int i, ret;
 
     if (cpu < 0 || cpu >= MAX_CPUS) {
         scx_bpf_consume(SCX_DSQ_GLOBAL);
         return 0;
     }
 
+    if (scx_bpf_consume(clutch_bound_dsq_id(cpu))) {
+        clutch_stat_inc(CLUTCH_STAT_BOUND_DISPATCH);
+        return 0;
+    }
+
     cluster_id = clutch_cpu_to_cluster(cpu);
     cluster = clutch_cluster_ctx(cluster_id);
     if (!cluster) {
@@ -793,87 +2808,204 @@ int BPF_PROG(clutch_dispatch, s32 cpu, struct task_struct *prev)
         return 0;
     }
 
-    group_se = clutch_pick_group(cluster, cluster_id);
-    if (!group_se) {
-        scx_bpf_consume(SCX_DSQ_GLOBAL);
+    if (clutch_engine == CLUTCH_ENGINE_DSQ) {
+        if (clutch_dsq_dispatch(cluster_id) && !clutch_steal(cluster_id, cpu))
+            scx_bpf_consume(SCX_DSQ_GLOBAL);
         return 0;
     }
 
-    key.cluster_id = group_se->cluster_id;
-    key.group_id = (u32)group_se->pid;
-    slot = bpf_map_lookup_elem(&group_ctx_map, &key);
-    if (!slot) {
-        bpf_obj_drop(group_se);
-        scx_bpf_consume(SCX_DSQ_GLOBAL);
-        return 0;
-    }
+    nr_batch = clutch_dispatch_batch();
 
-    bpf_spin_lock(&slot->lock);
-    if (!slot->nr_children) {
-        bpf_spin_unlock(&slot->lock);
-        bpf_obj_drop(group_se);
-        scx_bpf_consume(SCX_DSQ_GLOBAL);
-        return 0;
+    bpf_for(i, 0, CLUTCH_MAX_DISPATCH_BATCH + CLUTCH_DISPATCH_RETRIES +
+                  CLUTCH_DISPATCH_STALE_MAX) {
+        if (nr_dispatched >= nr_batch)
+            break;
+
+        ret = clutch_dispatch_group(cluster, cluster_id, cpu, false);
+        if (!ret) {
+            nr_dispatched++;
+            continue;
+        }
+        if (ret == -ESTALE)
+            continue;
+        if (ret != -EAGAIN || ++nr_misses >= CLUTCH_DISPATCH_RETRIES)
+            break;
     }
 
-    rb = bpf_rbtree_first(&slot->thread_cfs_rq);
-    if (!rb) {
-        slot->nr_children = 0;
-        bpf_spin_unlock(&slot->lock);
-        bpf_obj_drop(group_se);
+    if (nr_dispatched > 1)
+        clutch_stat_add(CLUTCH_STAT_DISPATCH_BATCHED, nr_dispatched);
+
+    if (!nr_dispatched && !clutch_steal(cluster_id, cpu))
         scx_bpf_consume(SCX_DSQ_GLOBAL);
-        return 0;
+
+    return 0;
+}
+
+/* cluster 当前按 EDF（及 warp）应该最先服务的非空 bucket；没有排队工作时返回 -1。 */
+static __always_inline s32 clutch_cluster_best_bucket(u32 cluster_id, bool *warped)
+{
+    struct cluster_ctx *cluster = clutch_cluster_ctx(cluster_id);
+
+    *warped = false;
+    if (!cluster)
+        return -1;
+
+    if (clutch_engine == CLUTCH_ENGINE_DSQ)
+        return clutch_select_bucket(cluster, clutch_dsq_bucket_mask(cluster_id), warped);
+
+    return clutch_pick_bucket_id(cluster, warped);
+}
+
+/* 同一 bucket 内比较正在运行线程所属组与 bucket 队头组的 vruntime。
+ * 运行组的 vruntime 在 dispatch 时预记了整片 slice，这里换成截至本次 tick 的实际值，
+ * 并与队头的排序键一样加上分时优先级偏移。
+ * 队头组落后超过 CLUTCH_TICK_GRAN_NS 才认为值得让出，避免每个 tick 来回切换。
+ */
+static __always_inline bool clutch_tick_group_behind(u32 cluster_id, u32 bucket_id,
+                                                     struct thread_ctx *tctx)
+{
+    struct group_key key = tctx->group;
+    struct bucket_ctx *bucket;
+    struct group_ctx *slot;
+    struct clutch_se *head;
+    u64 head_vruntime = 0, cur;
+    bool found = false;
+
+    bucket = clutch_bucket_ctx(cluster_id, bucket_id);
+    slot = bpf_map_lookup_elem(&group_ctx_map, &key);
+    if (!bucket || !slot)
+        return false;
+
+    bpf_spin_lock(&bucket->lock);
+    head = clutch_eevdf_peek_locked(&bucket->group_eligible_rq, &bucket->group_cfs_rq);
+    if (head) {
+        if (head->cluster_id != key.cluster_id || head->pid != key.group_id) {
+            head_vruntime = head->vruntime;
+            found = true;
+        }
     }
+    bpf_spin_unlock(&bucket->lock);
 
-    rb = bpf_rbtree_remove(&slot->thread_cfs_rq, rb);
-    if (!rb) {
-        bpf_spin_unlock(&slot->lock);
-        bpf_obj_drop(group_se);
-        scx_bpf_consume(SCX_DSQ_GLOBAL);
-        return 0;
+    if (!found)
+        return false;
+
+    cur = READ_ONCE(slot->vruntime);
+    cur = cur > tctx->group_charge ? cur - tctx->group_charge : 0;
+    cur += tctx->run_delta_v + clutch_ts_penalty(READ_ONCE(slot->ts_pri));
+
+    return cur > head_vruntime + CLUTCH_TICK_GRAN_NS;
+}
+
+SEC("struct_ops/tick")
+/* 运行中任务的周期性 tick 回调。
+ * 先把上次记账点以来的运行时间折算进线程 vruntime（stopping 只再补记剩余部分），
+ * 再与本 CPU 所在 cluster 的 EDF bucket 队头比较：有更早 deadline 的 bucket，
+ * 或同一 bucket 内有明显落后的其它组在等待时，把 slice 清零让内核尽快重新调度。
+ */
+void BPF_PROG(clutch_tick, struct task_struct *p)
+{
+    struct cluster_ctx *cluster;
+    struct thread_ctx *tctx;
+    u64 now = bpf_ktime_get_ns();
+    u32 cluster_id;
+    s32 best_bucket;
+    bool warped;
+
+    tctx = bpf_task_storage_get(&thread_ctx_map, p, 0, 0);
+    if (!tctx || !tctx->is_running)
+        return;
+
+    if (tctx->last_run_ns && now > tctx->last_run_ns) {
+        u64 delta_v = clutch_scale_delta(now - tctx->last_run_ns, tctx->wmult);
+
+        tctx->vruntime += delta_v;
+        tctx->run_delta_v += delta_v;
+        tctx->last_run_ns = now;
     }
 
-    thread_se = container_of(rb, struct clutch_se, rb_node);
-    if (slot->nr_children)
-        slot->nr_children--;
-    clutch_refresh_group_key_locked(slot);
-    bpf_spin_unlock(&slot->lock);
+    if (!p->scx.slice)
+        return;
 
-    bpf_obj_drop(group_se);
+    cluster_id = clutch_cpu_to_cluster(scx_bpf_task_cpu(p));
+    cluster = clutch_cluster_ctx(cluster_id);
+    best_bucket = clutch_cluster_best_bucket(cluster_id, &warped);
+    if (!cluster || best_bucket < 0)
+        return;
 
-    if (clutch_dispatch_thread(thread_se, cpu)) {
-        bpf_obj_drop(thread_se);
-        scx_bpf_consume(SCX_DSQ_GLOBAL);
-        return 0;
+    if (warped ? (u32)best_bucket < tctx->bucket_id :
+        clutch_bucket_abs_deadline(cluster, (u32)best_bucket) <
+        clutch_bucket_abs_deadline(cluster, tctx->bucket_id)) {
+        p->scx.slice = 0;
+        clutch_stat_inc(CLUTCH_STAT_TICK_PREEMPT_BUCKET);
+        return;
     }
 
-    return 0;
+    if (clutch_engine != CLUTCH_ENGINE_RBTREE || !tctx->group_charged ||
+        (u32)best_bucket != tctx->bucket_id)
+        return;
+
+    if (clutch_tick_group_behind(cluster_id, (u32)best_bucket, tctx)) {
+        p->scx.slice = 0;
+        clutch_stat_inc(CLUTCH_STAT_TICK_PREEMPT_VRUNTIME);
+    }
+}
+
+/* 线程进入睡眠时保存它相对所在组平均 vruntime 的 lag，醒来入队时据此放置。 */
+static __always_inline void clutch_thread_save_lag(struct thread_ctx *tctx)
+{
+    struct group_key key = tctx->group;
+    struct group_ctx *slot;
+
+    slot = bpf_map_lookup_elem(&group_ctx_map, &key);
+    if (!slot)
+        return;
+
+    tctx->vlag = clutch_entity_lag(READ_ONCE(slot->avg.cur), tctx->vruntime,
+                                   clutch_lag_limit(key.bucket_id, tctx->wmult));
+    tctx->lag_valid = true;
 }
 
 SEC("struct_ops/stopping")
 /* 任务停止运行时的回调。
- * 这里根据 thread_ctx 中的权威状态累加 vruntime。
- * percpu cpu_run_state_map 只作为本 CPU 的运行快照，停止时做最佳努力清理；
- * 如果任务仍然可运行，则重新放回 clutch 队列；失败时回退到全局 DSQ。
+ * 这里根据 thread_ctx 中的权威状态累加线程 vruntime，修正所属组的预记 vruntime，
+ * 并记录停止时间供窃取时判断缓存热度。
+ * cpu_run_state_map[cpu] 只作为该 CPU 的运行快照，停止时做最佳努力清理。
+ * 任务仍然可运行时由 sched_ext 重新调用 enqueue（或放回本地 DSQ），两种引擎都不在这里重复入队，
+ * 否则同一任务会有两个节点，前一个节点计入的排队数再也不会被认领。
  */
 int BPF_PROG(clutch_stopping, struct task_struct *p, bool runnable)
 {
     struct cpu_run_state *acct;
     struct thread_ctx *tctx;
-    u32 key = CPU_RUN_STATE_KEY;
+    s32 cpu = scx_bpf_task_cpu(p);
 
-    acct = bpf_map_lookup_elem(&cpu_run_state_map, &key);
+    acct = bpf_map_lookup_elem(&cpu_run_state_map, &cpu);
     tctx = bpf_task_storage_get(&thread_ctx_map, p, 0, 0);
 
-    if (tctx && tctx->is_running && tctx->last_run_ns) {
+    if (tctx) {
         u64 now = bpf_ktime_get_ns();
-        u64 delta_ns = now - tctx->last_run_ns;
-        u64 delta_v = (delta_ns * NICE_0_LOAD * tctx->wmult) >> 32;
+        u64 delta_v = 0, used_ns = 0;
 
-        tctx->vruntime += delta_v;
-    }
+        if (tctx->is_running && tctx->last_run_ns && now > tctx->last_run_ns) {
+            delta_v = clutch_scale_delta(now - tctx->last_run_ns, tctx->wmult);
+            tctx->vruntime += delta_v;
+        }
+        if (tctx->is_running && tctx->run_start_ns && now > tctx->run_start_ns)
+            used_ns = now - tctx->run_start_ns;
 
-    if (tctx) {
+        if (tctx->group_charged)
+            clutch_group_settle(tctx, tctx->run_delta_v + delta_v, used_ns, now);
+        else if (tctx->group_valid && clutch_engine == CLUTCH_ENGINE_RBTREE && used_ns)
+            clutch_group_account(&tctx->group, used_ns, now);
+
+        if (!runnable && tctx->group_valid && clutch_engine == CLUTCH_ENGINE_RBTREE)
+            clutch_thread_save_lag(tctx);
+
+        tctx->run_delta_v = 0;
+        tctx->run_start_ns = 0;
+        tctx->sleeping = !runnable;
+
+        tctx->last_stop_ns = now;
         tctx->last_run_ns = 0;
         tctx->run_cpu = -1;
         tctx->is_running = false;
@@ -887,8 +3019,252 @@ int BPF_PROG(clutch_stopping, struct task_struct *p, bool runnable)
         acct->run_cpu = -1;
     }
 
-    if (runnable && clutch_enqueue_thread(p))
-        scx_bpf_dispatch(p, SCX_DSQ_GLOBAL, clutch_calculate_slice(p), 0);
+    return 0;
+}
+
+/* 尝试把已被 dequeue 的线程节点立即摘掉。
+ * BPF rbtree 只能删除 first() 得到的节点，所以只有它恰好是组内队头时才能立即删除；
+ * 否则节点留在树里，等 dispatch 取到时按 seq 不匹配丢弃。
+ * cluster 的排队计数已由调用方认领并减掉，这里只处理组内状态。
+ */
+static __always_inline void clutch_dequeue_head(const struct group_key *key, s32 pid, u64 seq)
+{
+    struct bpf_rb_node *removed = NULL;
+    struct clutch_se *thread_se;
+    struct group_ctx *slot;
+
+    slot = bpf_map_lookup_elem(&group_ctx_map, key);
+    if (!slot)
+        return;
+
+    bpf_spin_lock(&slot->lock);
+    thread_se = clutch_eevdf_peek_locked(&slot->thread_eligible_rq, &slot->thread_cfs_rq);
+    if (thread_se && thread_se->pid == pid && thread_se->seq == seq)
+        removed = clutch_eevdf_remove_locked(&slot->thread_eligible_rq, &slot->thread_cfs_rq,
+                                             thread_se);
+    if (removed) {
+        thread_se = container_of(removed, struct clutch_se, rb_node);
+        clutch_avg_sub(&slot->avg, thread_se->vruntime, clutch_wmult_weight(thread_se->wmult));
+        if (slot->nr_children)
+            slot->nr_children--;
+        clutch_refresh_group_key_locked(slot);
+    }
+    bpf_spin_unlock(&slot->lock);
+
+    if (!removed)
+        return;
+
+    clutch_se_free(container_of(removed, struct clutch_se, rb_node));
+    clutch_stat_inc(CLUTCH_STAT_DEQUEUE_EAGER);
+}
+
+SEC("struct_ops/dequeue")
+/* 任务离开 BPF 调度器托管时的回调（改亲和性、迁移、退出、切换调度类等）。
+ * 推进入队序号使树中的旧节点失效，节点是组内队头时顺手删除。
+ * 无论节点能否立即删除，cluster 的排队计数都在这里认领并减掉，
+ * 留在树中的失效节点不会继续抬高窃取、时间片与 fork 放置看到的负载。
+ * 只有 rbtree 引擎会置 queued；DSQ 引擎下任务由内核从 DSQ 中移除，这里直接返回。
+ */
+void BPF_PROG(clutch_dequeue, struct task_struct *p, u64 deq_flags)
+{
+    struct thread_ctx *tctx;
+    u64 seq;
+
+    tctx = bpf_task_storage_get(&thread_ctx_map, p, 0, 0);
+    if (!tctx || !tctx->queued)
+        return;
+
+    seq = tctx->enq_seq;
+    tctx->enq_seq = seq + 1;
+    tctx->queued = false;
+    clutch_stat_inc(CLUTCH_STAT_DEQUEUE);
+
+    if (!tctx->group_valid)
+        return;
+
+    clutch_thread_release_queued(tctx, seq);
+    clutch_dequeue_head(&tctx->group, p->pid, seq);
+}
+
+SEC("struct_ops.s/init_task")
+/* 任务进入 sched_ext 时的回调（fork 出的新任务，或调度器加载时已经存在的任务）。
+ * thread_ctx 在这里创建，之后入队、派发等热路径只查找不分配；创建失败时让 fork 失败。
+ * fork 出的任务此时还不知道会落在哪个 cluster（select_cpu 在之后才按负载选核），
+ * 因此红黑树引擎不在这里决定 vruntime，而是给它一个按自身权重折算的一个 bucket 基准时间片
+ * 的负 lag，第一次入队时由 clutch_thread_place() 相对目标组的平均 vruntime 放置：
+ * 新任务排在目标组已有工作之后，连续 fork 也不会让子任务挤到所有线程前面。
+ * 初始 vruntime 沿用父任务（即当前任务）的值，只在目标组是新建组时作为它的起点；
+ * DSQ 引擎没有组，直接取父任务 vruntime 加一个时间片。
+ */
+s32 BPF_PROG(clutch_init_task, struct task_struct *p, struct scx_init_task_args *args)
+{
+    struct thread_ctx *tctx, *ptctx;
+    u64 vslice;
+
+    tctx = bpf_task_storage_get(&thread_ctx_map, p, 0, BPF_LOCAL_STORAGE_GET_F_CREATE);
+    if (!tctx)
+        return -ENOMEM;
+
+    if (!args->fork)
+        return 0;
+
+    vslice = clutch_scale_delta(clutch_bucket_base_slice(clutch_bucket_id(p, tctx)),
+                                clutch_task_wmult(p));
+    ptctx = bpf_task_storage_get(&thread_ctx_map, bpf_get_current_task_btf(), 0, 0);
+    tctx->vruntime = ptctx ? ptctx->vruntime : 0;
+
+    if (clutch_engine == CLUTCH_ENGINE_RBTREE) {
+        tctx->vlag = -(s64)vslice;
+        tctx->lag_valid = true;
+    } else {
+        tctx->vruntime += vslice;
+    }
+
+    return 0;
+}
+
+SEC("struct_ops/exit_task")
+/* 任务退出 sched_ext 时的回调。
+ * 任务最后所在的组若已经没有其它排队线程，就立即从 group_ctx_map 删除。
+ */
+void BPF_PROG(clutch_exit_task, struct task_struct *p, struct scx_exit_task_args *args)
+{
+    struct thread_ctx *tctx;
+
+    tctx = bpf_task_storage_get(&thread_ctx_map, p, 0, 0);
+    if (!tctx || !tctx->group_valid)
+        return;
+
+    tctx->group_valid = false;
+    clutch_group_release(&tctx->group);
+}
+
+/* 后台回收回调：删除空闲超过 CLUTCH_GROUP_IDLE_NS 的空组。 */
+static long clutch_group_reap_cb(struct bpf_map *map, struct group_key *key,
+                                 struct group_ctx *slot, u64 *now)
+{
+    clutch_group_try_reap(slot, key, *now, CLUTCH_GROUP_IDLE_NS);
+    return 0;
+}
+
+/* 周期性扫描 group_ctx_map，兜住 exit_task / 迁移路径没能删除的组
+ * （例如最后一个线程退出时组里还有其它线程，之后它们都睡眠了）。
+ */
+static int clutch_group_reaper(void *map, int *key, struct clutch_timer *timer)
+{
+    u64 now = bpf_ktime_get_ns();
+
+    bpf_for_each_map_elem(&group_ctx_map, clutch_group_reap_cb, &now, 0);
+    bpf_timer_start(&timer->timer, CLUTCH_GROUP_REAP_INTERVAL_NS, 0);
+    return 0;
+}
+
+/* 把 cpu 加入所属 cluster 的 cpumask 与 CPU 列表，cpumask 不存在时先创建。 */
+static __always_inline int clutch_cluster_add_cpu(u32 cluster_id, s32 cpu)
+{
+    struct bpf_cpumask *mask, *old;
+    struct cluster_ctx *cluster;
+    struct cluster_cpus *cc;
+    u32 idx;
+
+    cluster = clutch_cluster_ctx(cluster_id);
+    cc = bpf_map_lookup_elem(&cluster_cpus_map, &cluster_id);
+    if (!cluster || !cc)
+        return -ENOENT;
+
+    idx = cc->nr;
+    if (idx < CLUTCH_MAX_CLUSTER_CPUS) {
+        cc->cpus[idx] = (u16)cpu;
+        cc->nr = idx + 1;
+    }
+
+    if (!cluster->cpumask) {
+        mask = bpf_cpumask_create();
+        if (!mask)
+            return -ENOMEM;
+
+        old = bpf_kptr_xchg(&cluster->cpumask, mask);
+        if (old)
+            bpf_cpumask_release(old);
+    }
+
+    bpf_rcu_read_lock();
+    mask = cluster->cpumask;
+    if (mask)
+        bpf_cpumask_set_cpu(cpu, mask);
+    bpf_rcu_read_unlock();
+
+    return 0;
+}
+
+SEC("struct_ops.s/init")
+/* 调度器初始化回调。
+ * 统计 cluster 数，构建每个 cluster 的 cpumask 并为每个 CPU 创建绑定队列，补满各 bucket 的 warp 预算；
+ * rbtree 引擎启动组回收定时器，DSQ 引擎为每个 (cluster, bucket) 创建一个 vtime DSQ。
+ */
+s32 BPF_PROG(clutch_init)
+{
+    struct clutch_timer *timer;
+    u32 nr_clusters = 1, key = 0;
+    int cpu, cluster_id, bucket_id;
+    s32 ret;
+
+    bpf_for(cpu, 0, clutch_nr_cpus()) {
+        u32 cid = clutch_cpu_to_cluster(cpu);
+
+        if (cid + 1 > nr_clusters)
+            nr_clusters = cid + 1;
+
+        ret = clutch_cluster_add_cpu(cid, cpu);
+        if (ret) {
+            scx_bpf_error("failed to build cpumask for cluster %u: %d", cid, ret);
+            return ret;
+        }
+
+        ret = scx_bpf_create_dsq(clutch_bound_dsq_id(cpu), -1);
+        if (ret) {
+            scx_bpf_error("failed to create bound DSQ for cpu %d: %d", cpu, ret);
+            return ret;
+        }
+    }
+    clutch_nr_clusters = nr_clusters;
+
+    bpf_for(cluster_id, 0, nr_clusters) {
+        struct cluster_ctx *cluster = clutch_cluster_ctx(cluster_id);
+
+        if (!cluster)
+            continue;
+        bpf_for(bucket_id, 0, clutch_nr_buckets())
+            clutch_bucket_refill_warp(cluster, bucket_id);
+    }
+
+    if (clutch_engine != CLUTCH_ENGINE_DSQ) {
+        timer = bpf_map_lookup_elem(&clutch_reaper_timer, &key);
+        if (!timer) {
+            scx_bpf_error("failed to look up group reaper timer");
+            return -ENOENT;
+        }
+
+        bpf_timer_init(&timer->timer, &clutch_reaper_timer, CLOCK_MONOTONIC);
+        bpf_timer_set_callback(&timer->timer, clutch_group_reaper);
+        ret = bpf_timer_start(&timer->timer, CLUTCH_GROUP_REAP_INTERVAL_NS, 0);
+        if (ret) {
+            scx_bpf_error("failed to start group reaper timer: %d", ret);
+            return ret;
+        }
+        return 0;
+    }
+
+    bpf_for(cluster_id, 0, nr_clusters) {
+        bpf_for(bucket_id, 0, clutch_nr_buckets()) {
+            ret = scx_bpf_create_dsq(clutch_bucket_dsq_id(cluster_id, bucket_id), -1);
+            if (ret) {
+                scx_bpf_error("failed to create DSQ for cluster %d bucket %d: %d",
+                              cluster_id, bucket_id, ret);
+                return ret;
+            }
+        }
+    }
 
     return 0;
 }
@@ -907,9 +3283,14 @@ SEC(".struct_ops")
 struct sched_ext_ops clutch_ops = {
     .select_cpu = (void *)clutch_select_cpu,
     .enqueue    = (void *)clutch_enqueue,
+    .dequeue    = (void *)clutch_dequeue,
     .dispatch   = (void *)clutch_dispatch,
     .running    = (void *)clutch_running,
+    .tick       = (void *)clutch_tick,
     .stopping   = (void *)clutch_stopping,
+    .init_task  = (void *)clutch_init_task,
+    .exit_task  = (void *)clutch_exit_task,
     .enable     = (void *)clutch_enable,
+    .init       = (void *)clutch_init,
     .name       = "global_clutch",
 };
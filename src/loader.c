@@ -2,12 +2,15 @@
 #include <unistd.h>
 #include <signal.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+#include "clutch_stats.h"
 
 typedef uint32_t u32;
 typedef uint64_t u64;
@@ -18,6 +21,21 @@ typedef int64_t  s64;
 #define MAX_CLUTCH_BUCKETS 8
 #define CORES_PER_CLUSTER 5
 #define DEFAULT_CLUTCH_BUCKETS 5
+#define CLUTCH_TASK_LOOKUP_KPTR 0
+#define CLUTCH_TASK_LOOKUP_PID  1
+#define CLUTCH_MAX_DISPATCH_BATCH 64
+#define CLUTCH_ENGINE_RBTREE    0
+#define CLUTCH_ENGINE_DSQ       1
+#define SCX_DFL_DISPATCH_MAX_BATCH 32
+#define MAX_GROUPS              16384
+#define GROUP_OCCUPANCY_WARN_PCT 90
+#define CLUTCH_STEAL_IMBALANCE  2
+#define CLUTCH_GROUP_BY_PID     0
+#define CLUTCH_GROUP_BY_TGID    1
+#define CLUTCH_GROUP_BY_CGROUP  2
+#define CLUTCH_STEAL_MIGRATION_COST_NS 500000ULL
+#define CLUTCH_SLICE_MIN_NS     500000ULL
+#define CLUTCH_SLICE_MAX_NS     20000000ULL
 
 static const u64 default_bucket_ddl_ns[MAX_CLUTCH_BUCKETS] = {
     0ULL,        /* FG */
@@ -25,6 +43,25 @@ static const u64 default_bucket_ddl_ns[MAX_CLUTCH_BUCKETS] = {
     75000000ULL, /* DF: 75ms */
     150000000ULL,/* UT: 150ms */
     250000000ULL,/* BG: 250ms */
+    250000000ULL,
+    250000000ULL,
+    250000000ULL,
+};
+
+static const u64 default_bucket_warp_ns[MAX_CLUTCH_BUCKETS] = {
+    8000000ULL,  /* FG: 8ms */
+    4000000ULL,  /* IN: 4ms */
+    2000000ULL,  /* DF: 2ms */
+    1000000ULL,  /* UT: 1ms */
+    0ULL,        /* BG */
+};
+
+static const u64 default_bucket_slice_ns[MAX_CLUTCH_BUCKETS] = {
+    2000000ULL,  /* FG: 2ms */
+    3000000ULL,  /* IN: 3ms */
+    4000000ULL,  /* DF: 4ms */
+    8000000ULL,  /* UT: 8ms */
+    12000000ULL, /* BG: 12ms */
 };
 
 #ifdef SKEL_H
@@ -71,6 +108,73 @@ struct cluster_topology {
 struct bucket_config {
     u32 nr_buckets;
     u64 ddl_ns[MAX_CLUTCH_BUCKETS];
+    u64 warp_ns[MAX_CLUTCH_BUCKETS];
+    u64 slice_ns[MAX_CLUTCH_BUCKETS];
+    u64 slice_min_ns;
+    u64 slice_max_ns;
+};
+
+/* 命令行指定的一条 QoS 覆盖：tgid 或 cgroup id -> bucket。 */
+struct qos_override {
+    u64 id;
+    u32 bucket;
+};
+
+struct loader_config {
+    struct bucket_config buckets;
+    u32 stats_interval_s;
+    u32 task_lookup;
+    bool bench_dispatch;
+    u32 dispatch_batch;
+    u32 engine;
+    u32 steal_imbalance;
+    u64 steal_migration_cost_ns;
+    u32 group_by;
+    bool no_preempt;
+    bool eevdf;
+    struct qos_override qos_tgid[CLUTCH_MAX_QOS_OVERRIDES];
+    u32 nr_qos_tgid;
+    struct qos_override qos_cgroup[CLUTCH_MAX_QOS_OVERRIDES];
+    u32 nr_qos_cgroup;
+};
+
+/* 与 BPF 侧 CLUTCH_BUCKET_* 编号一致的 bucket 名称。 */
+static const char *const bucket_names[] = { "fg", "in", "df", "ut", "bg" };
+
+static const char *const group_by_names[] = {
+    [CLUTCH_GROUP_BY_PID]    = "pid",
+    [CLUTCH_GROUP_BY_TGID]   = "tgid",
+    [CLUTCH_GROUP_BY_CGROUP] = "cgroup",
+};
+
+static const char *const stat_names[CLUTCH_NR_STATS] = {
+    [CLUTCH_STAT_SE_POOL_HIT]     = "se_pool_hit",
+    [CLUTCH_STAT_SE_POOL_MISS]    = "se_pool_miss",
+    [CLUTCH_STAT_SE_POOL_REFILL]  = "se_pool_refill",
+    [CLUTCH_STAT_SE_POOL_RECYCLE] = "se_pool_recycle",
+    [CLUTCH_STAT_SE_POOL_DROP]    = "se_pool_drop",
+    [CLUTCH_STAT_DISPATCH_NS]     = "dispatch_ns",
+    [CLUTCH_STAT_DISPATCH_SAMPLES] = "dispatch_samples",
+    [CLUTCH_STAT_DISPATCH_BATCHED] = "dispatch_batched",
+    [CLUTCH_STAT_SELECT_CPU]      = "select_cpu",
+    [CLUTCH_STAT_IDLE_DIRECT]     = "idle_direct",
+    [CLUTCH_STAT_KICK_IDLE]       = "kick_idle",
+    [CLUTCH_STAT_STEAL]           = "steal",
+    [CLUTCH_STAT_STEAL_HOT]       = "steal_hot",
+    [CLUTCH_STAT_STEAL_AFFINITY]  = "steal_affinity",
+    [CLUTCH_STAT_GROUP_CREATE]    = "group_create",
+    [CLUTCH_STAT_GROUP_EVICT]     = "group_evict",
+    [CLUTCH_STAT_GROUP_FULL]      = "group_full",
+    [CLUTCH_STAT_DEQUEUE]         = "dequeue",
+    [CLUTCH_STAT_DEQUEUE_EAGER]   = "dequeue_eager",
+    [CLUTCH_STAT_DEQUEUE_STALE]   = "dequeue_stale",
+    [CLUTCH_STAT_BOUND_ENQUEUE]   = "bound_enqueue",
+    [CLUTCH_STAT_BOUND_DISPATCH]  = "bound_dispatch",
+    [CLUTCH_STAT_PREEMPT_KICK]    = "preempt_kick",
+    [CLUTCH_STAT_TICK_PREEMPT_BUCKET]   = "tick_preempt_bucket",
+    [CLUTCH_STAT_TICK_PREEMPT_VRUNTIME] = "tick_preempt_vruntime",
+    [CLUTCH_STAT_QOS_CLASSIFY]    = "qos_classify",
+    [CLUTCH_STAT_FORK_PLACE]      = "fork_place",
 };
 
 static void sig_handler(int sig)
@@ -223,9 +327,16 @@ static void bucket_config_set_defaults(struct bucket_config *cfg)
 {
     u32 i;
 
-    *cfg = (struct bucket_config){ .nr_buckets = DEFAULT_CLUTCH_BUCKETS };
-    for (i = 0; i < MAX_CLUTCH_BUCKETS; i++)
+    *cfg = (struct bucket_config){
+        .nr_buckets = DEFAULT_CLUTCH_BUCKETS,
+        .slice_min_ns = CLUTCH_SLICE_MIN_NS,
+        .slice_max_ns = CLUTCH_SLICE_MAX_NS,
+    };
+    for (i = 0; i < MAX_CLUTCH_BUCKETS; i++) {
         cfg->ddl_ns[i] = default_bucket_ddl_ns[i];
+        cfg->warp_ns[i] = default_bucket_warp_ns[i];
+        cfg->slice_ns[i] = default_bucket_slice_ns[i];
+    }
 }
 
 static int parse_u32_arg(const char *arg, u32 *value)
@@ -242,7 +353,70 @@ static int parse_u32_arg(const char *arg, u32 *value)
     return 0;
 }
 
-static int parse_bucket_ddls(const char *arg, struct bucket_config *cfg)
+/* 解析 bucket 名称（fg/in/df/ut/bg）或编号；编号是否超出活跃 bucket 数由调用方检查。 */
+static int parse_qos_bucket(const char *arg, u32 *bucket)
+{
+    char *end = NULL;
+    unsigned long parsed;
+    u32 i;
+
+    for (i = 0; i < sizeof(bucket_names) / sizeof(bucket_names[0]); i++) {
+        if (!strcmp(arg, bucket_names[i])) {
+            *bucket = i;
+            return 0;
+        }
+    }
+
+    errno = 0;
+    parsed = strtoul(arg, &end, 10);
+    if (errno || !end || end == arg || *end != '\0' || parsed >= MAX_CLUTCH_BUCKETS)
+        return -EINVAL;
+
+    *bucket = (u32)parsed;
+    return 0;
+}
+
+/* 解析 --qos-tgid=TGID:BUCKET 或 --qos-cgroup=PATH:BUCKET。
+ * cgroup 路径取 cgroup v2 目录的 inode 号，与 BPF 侧读到的 kernfs id 相同。
+ */
+static int parse_qos_override(const char *arg, bool cgroup, struct qos_override *ovr)
+{
+    char buf[512];
+    char *sep;
+    struct stat st;
+    u32 tgid;
+    int err;
+
+    if (strlen(arg) >= sizeof(buf))
+        return -E2BIG;
+
+    strcpy(buf, arg);
+    sep = strrchr(buf, ':');
+    if (!sep || sep == buf)
+        return -EINVAL;
+    *sep = '\0';
+
+    err = parse_qos_bucket(sep + 1, &ovr->bucket);
+    if (err)
+        return err;
+
+    if (cgroup) {
+        if (stat(buf, &st) || !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "Cannot stat cgroup directory %s\n", buf);
+            return -ENOENT;
+        }
+        ovr->id = (u64)st.st_ino;
+        return 0;
+    }
+
+    err = parse_u32_arg(buf, &tgid);
+    if (err)
+        return err;
+    ovr->id = tgid;
+    return 0;
+}
+
+static int parse_bucket_ns_list(const char *arg, u64 *values, bool allow_zero)
 {
     char buf[256];
     char *token;
@@ -255,31 +429,38 @@ static int parse_bucket_ddls(const char *arg, struct bucket_config *cfg)
 
     for (token = strtok(buf, ","); token; token = strtok(NULL, ",")) {
         char *end = NULL;
-        unsigned long long ddl;
+        unsigned long long value;
 
         if (idx >= MAX_CLUTCH_BUCKETS)
             return -E2BIG;
 
         errno = 0;
-        ddl = strtoull(token, &end, 10);
-        if (errno || !end || *end != '\0' || !ddl)
+        value = strtoull(token, &end, 10);
+        if (errno || !end || *end != '\0' || (!value && !allow_zero))
             return -EINVAL;
 
-        cfg->ddl_ns[idx++] = (u64)ddl;
+        values[idx++] = (u64)value;
     }
 
     return idx ? 0 : -EINVAL;
 }
 
-static int parse_bucket_config(int argc, char **argv, struct bucket_config *cfg)
+static int parse_loader_config(int argc, char **argv, struct loader_config *cfg)
 {
+    struct bucket_config *buckets = &cfg->buckets;
     int i;
 
-    bucket_config_set_defaults(cfg);
+    *cfg = (struct loader_config){
+        .dispatch_batch = 1,
+        .steal_imbalance = CLUTCH_STEAL_IMBALANCE,
+        .steal_migration_cost_ns = CLUTCH_STEAL_MIGRATION_COST_NS,
+        .group_by = CLUTCH_GROUP_BY_TGID,
+    };
+    bucket_config_set_defaults(buckets);
 
     for (i = 1; i < argc; i++) {
         if (!strncmp(argv[i], "--nr-buckets=", 13)) {
-            int err = parse_u32_arg(argv[i] + 13, &cfg->nr_buckets);
+            int err = parse_u32_arg(argv[i] + 13, &buckets->nr_buckets);
 
             if (err)
                 return err;
@@ -287,40 +468,363 @@ static int parse_bucket_config(int argc, char **argv, struct bucket_config *cfg)
         }
 
         if (!strncmp(argv[i], "--bucket-ddl=", 13)) {
-            int err = parse_bucket_ddls(argv[i] + 13, cfg);
+            int err = parse_bucket_ns_list(argv[i] + 13, buckets->ddl_ns, true);
+
+            if (err)
+                return err;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "--bucket-warp=", 14)) {
+            int err = parse_bucket_ns_list(argv[i] + 14, buckets->warp_ns, true);
+
+            if (err)
+                return err;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "--bucket-slice=", 15)) {
+            int err = parse_bucket_ns_list(argv[i] + 15, buckets->slice_ns, false);
+
+            if (err)
+                return err;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "--slice-min=", 12)) {
+            char *end = NULL;
+
+            errno = 0;
+            buckets->slice_min_ns = strtoull(argv[i] + 12, &end, 10);
+            if (errno || !end || *end != '\0' || !buckets->slice_min_ns)
+                return -EINVAL;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "--slice-max=", 12)) {
+            char *end = NULL;
+
+            errno = 0;
+            buckets->slice_max_ns = strtoull(argv[i] + 12, &end, 10);
+            if (errno || !end || *end != '\0' || !buckets->slice_max_ns)
+                return -EINVAL;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "--stats=", 8)) {
+            int err = parse_u32_arg(argv[i] + 8, &cfg->stats_interval_s);
+
+            if (err)
+                return err;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "--task-lookup=", 14)) {
+            const char *mode = argv[i] + 14;
+
+            if (!strcmp(mode, "kptr"))
+                cfg->task_lookup = CLUTCH_TASK_LOOKUP_KPTR;
+            else if (!strcmp(mode, "pid"))
+                cfg->task_lookup = CLUTCH_TASK_LOOKUP_PID;
+            else
+                return -EINVAL;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "--dispatch-batch=", 17)) {
+            int err = parse_u32_arg(argv[i] + 17, &cfg->dispatch_batch);
 
             if (err)
                 return err;
             continue;
         }
 
+        if (!strncmp(argv[i], "--engine=", 9)) {
+            const char *engine = argv[i] + 9;
+
+            if (!strcmp(engine, "rbtree"))
+                cfg->engine = CLUTCH_ENGINE_RBTREE;
+            else if (!strcmp(engine, "dsq"))
+                cfg->engine = CLUTCH_ENGINE_DSQ;
+            else
+                return -EINVAL;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "--group-by=", 11)) {
+            const char *mode = argv[i] + 11;
+
+            if (!strcmp(mode, "pid"))
+                cfg->group_by = CLUTCH_GROUP_BY_PID;
+            else if (!strcmp(mode, "tgid"))
+                cfg->group_by = CLUTCH_GROUP_BY_TGID;
+            else if (!strcmp(mode, "cgroup"))
+                cfg->group_by = CLUTCH_GROUP_BY_CGROUP;
+            else
+                return -EINVAL;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "--steal-imbalance=", 18)) {
+            int err = parse_u32_arg(argv[i] + 18, &cfg->steal_imbalance);
+
+            if (err)
+                return err;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "--steal-cost=", 13)) {
+            char *end = NULL;
+
+            errno = 0;
+            cfg->steal_migration_cost_ns = strtoull(argv[i] + 13, &end, 10);
+            if (errno || !end || *end != '\0')
+                return -EINVAL;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--no-steal")) {
+            cfg->steal_imbalance = 0;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--no-preempt")) {
+            cfg->no_preempt = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--eevdf")) {
+            cfg->eevdf = true;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "--qos-tgid=", 11)) {
+            if (cfg->nr_qos_tgid >= CLUTCH_MAX_QOS_OVERRIDES)
+                return -E2BIG;
+            if (parse_qos_override(argv[i] + 11, false, &cfg->qos_tgid[cfg->nr_qos_tgid]))
+                return -EINVAL;
+            cfg->nr_qos_tgid++;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "--qos-cgroup=", 13)) {
+            if (cfg->nr_qos_cgroup >= CLUTCH_MAX_QOS_OVERRIDES)
+                return -E2BIG;
+            if (parse_qos_override(argv[i] + 13, true, &cfg->qos_cgroup[cfg->nr_qos_cgroup]))
+                return -EINVAL;
+            cfg->nr_qos_cgroup++;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--bench-dispatch")) {
+            cfg->bench_dispatch = true;
+            continue;
+        }
+
         if (!strcmp(argv[i], "--help")) {
-            printf("Usage: %s [--nr-buckets=N] [--bucket-ddl=ns0,ns1,...]\n", argv[0]);
+            printf("Usage: %s [--nr-buckets=N] [--bucket-ddl=ns0,ns1,...] [--bucket-warp=ns0,ns1,...]\n"
+                   "          [--bucket-slice=ns0,ns1,...] [--slice-min=ns] [--slice-max=ns]\n"
+                   "          [--stats=SEC]\n"
+                   "          [--task-lookup=kptr|pid] [--bench-dispatch] [--dispatch-batch=N]\n"
+                   "          [--engine=rbtree|dsq] [--steal-imbalance=N] [--steal-cost=ns]\n"
+                   "          [--no-steal] [--group-by=pid|tgid|cgroup] [--no-preempt] [--eevdf]\n"
+                   "          [--qos-tgid=TGID:BUCKET] [--qos-cgroup=PATH:BUCKET]\n",
+                   argv[0]);
             printf("  --nr-buckets   active top-level clutch bucket count (1-%d)\n",
                    MAX_CLUTCH_BUCKETS);
-            printf("  --bucket-ddl   per-bucket deadline in ns, earliest bucket wins\n");
+            printf("  --bucket-ddl   per-bucket deadline in ns (0 = due immediately), earliest bucket wins\n");
+            printf("  --bucket-warp  per-bucket warp budget in ns a higher bucket may jump the\n"
+                   "                 deadline order for; refilled when the bucket empties (0 = none)\n");
+            printf("  --bucket-slice per-bucket base time slice in ns, shrunk proportionally once a\n"
+                   "                 cluster has more queued threads than CPUs\n");
+            printf("  --slice-min    lower bound for the load-scaled slice (default %llu)\n",
+                   CLUTCH_SLICE_MIN_NS);
+            printf("  --slice-max    upper bound for the load-scaled slice (default %llu)\n",
+                   CLUTCH_SLICE_MAX_NS);
+            printf("  --stats        print scheduler counters every SEC seconds\n");
+            printf("  --task-lookup  how dispatch resolves the task: stored kptr (default) or pid\n");
+            printf("  --bench-dispatch  time every dispatch and report the average latency\n");
+            printf("  --dispatch-batch  max threads moved per ops.dispatch call (1-%d)\n",
+                   CLUTCH_MAX_DISPATCH_BATCH);
+            printf("  --engine       queueing backend: BPF rbtrees (default) or per-bucket vtime DSQs\n");
+            printf("  --steal-imbalance  min extra queued threads on a sibling cluster before an idle\n"
+                   "                     CPU steals from it (default %d)\n", CLUTCH_STEAL_IMBALANCE);
+            printf("  --steal-cost   ns after a thread stops during which it is cache-hot and not\n"
+                   "                 stolen (default %llu, 0 disables the check)\n",
+                   CLUTCH_STEAL_MIGRATION_COST_NS);
+            printf("  --no-steal     disable cross-cluster work stealing\n");
+            printf("  --group-by     what forms a clutch group: thread, process (default) or cgroup\n");
+            printf("  --no-preempt   never kick a busy CPU when an earlier-deadline bucket is enqueued\n");
+            printf("  --eevdf        pick groups and threads by earliest eligible virtual deadline\n"
+                   "                 instead of smallest vruntime (rbtree engine only)\n");
+            printf("  --qos-tgid     put every thread of TGID into BUCKET (fg|in|df|ut|bg or index),\n"
+                   "                 repeatable; otherwise policy and nice pick the bucket\n");
+            printf("  --qos-cgroup   put every thread in the cgroup v2 directory PATH into BUCKET,\n"
+                   "                 repeatable; tgid overrides win over cgroup overrides\n");
             return 1;
         }
     }
 
-    if (!cfg->nr_buckets || cfg->nr_buckets > MAX_CLUTCH_BUCKETS)
+    if (!buckets->nr_buckets || buckets->nr_buckets > MAX_CLUTCH_BUCKETS)
         return -EINVAL;
 
+    if (buckets->slice_min_ns > buckets->slice_max_ns)
+        return -EINVAL;
+
+    if (cfg->dispatch_batch > CLUTCH_MAX_DISPATCH_BATCH)
+        return -EINVAL;
+
+    for (i = 0; i < (int)cfg->nr_qos_tgid; i++) {
+        if (cfg->qos_tgid[i].bucket >= buckets->nr_buckets)
+            return -EINVAL;
+    }
+    for (i = 0; i < (int)cfg->nr_qos_cgroup; i++) {
+        if (cfg->qos_cgroup[i].bucket >= buckets->nr_buckets)
+            return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* 把命令行中的 QoS 覆盖写入 qos_tgid_map / qos_cgroup_map，需在 skeleton 加载后调用。 */
+static int apply_qos_overrides(SKEL_TYPE *skel, const struct loader_config *cfg)
+{
+    u32 i, tgid;
+    int err;
+
+    for (i = 0; i < cfg->nr_qos_tgid; i++) {
+        tgid = (u32)cfg->qos_tgid[i].id;
+        err = bpf_map__update_elem(skel->maps.qos_tgid_map, &tgid, sizeof(tgid),
+                                   &cfg->qos_tgid[i].bucket, sizeof(u32), BPF_ANY);
+        if (err)
+            return err;
+    }
+
+    for (i = 0; i < cfg->nr_qos_cgroup; i++) {
+        err = bpf_map__update_elem(skel->maps.qos_cgroup_map, &cfg->qos_cgroup[i].id,
+                                   sizeof(u64), &cfg->qos_cgroup[i].bucket, sizeof(u32),
+                                   BPF_ANY);
+        if (err)
+            return err;
+    }
+
     return 0;
 }
 
+/* 汇总每个 bucket 的 EDF 统计：选中次数、deadline miss 次数与平均迟到时间、warp 使用情况，
+ * 以及时间片的平均长度和分档分布。
+ */
+static void print_bucket_stats(SKEL_TYPE *skel, int nr_possible_cpus)
+{
+    struct clutch_bucket_stats *percpu;
+    u32 nr_buckets = skel->rodata->nr_clutch_buckets;
+    u32 idx, bin;
+    int cpu;
+
+    percpu = calloc(nr_possible_cpus, sizeof(*percpu));
+    if (!percpu)
+        return;
+
+    printf("buckets:");
+    for (idx = 0; idx < nr_buckets && idx < MAX_CLUTCH_BUCKETS; idx++) {
+        struct clutch_bucket_stats total = {};
+
+        if (bpf_map__lookup_elem(skel->maps.clutch_bucket_stats_map, &idx, sizeof(idx),
+                                 percpu, sizeof(*percpu) * nr_possible_cpus, 0))
+            continue;
+
+        for (cpu = 0; cpu < nr_possible_cpus; cpu++) {
+            total.selected += percpu[cpu].selected;
+            total.deadline_miss += percpu[cpu].deadline_miss;
+            total.miss_ns += percpu[cpu].miss_ns;
+            total.warp += percpu[cpu].warp;
+            total.warp_exhausted += percpu[cpu].warp_exhausted;
+            total.slices += percpu[cpu].slices;
+            total.slice_ns += percpu[cpu].slice_ns;
+            for (bin = 0; bin < CLUTCH_SLICE_HIST_BINS; bin++)
+                total.slice_hist[bin] += percpu[cpu].slice_hist[bin];
+        }
+
+        printf(" [%u] selected=%llu miss=%llu", idx,
+               (unsigned long long)total.selected,
+               (unsigned long long)total.deadline_miss);
+        if (total.deadline_miss)
+            printf(" miss_avg_us=%.1f",
+                   (double)total.miss_ns / total.deadline_miss / 1000.0);
+        printf(" warp=%llu warp_exhausted=%llu",
+               (unsigned long long)total.warp,
+               (unsigned long long)total.warp_exhausted);
+        if (total.slices)
+            printf(" slice_avg_us=%.1f",
+                   (double)total.slice_ns / total.slices / 1000.0);
+        printf(" slice_hist=");
+        for (bin = 0; bin < CLUTCH_SLICE_HIST_BINS; bin++)
+            printf("%s%llu", bin ? "/" : "", (unsigned long long)total.slice_hist[bin]);
+    }
+    printf("\n");
+
+    free(percpu);
+}
+
+/* 汇总 percpu 统计 map 并打印一行计数，退出时也会打印一次最终值。
+ * group_ctx_map 占用超过 GROUP_OCCUPANCY_WARN_PCT 时额外告警，此时新组即将
+ * 创建失败、新任务会回退到全局 DSQ。
+ */
+static void print_stats(SKEL_TYPE *skel, int nr_possible_cpus)
+{
+    u64 totals[CLUTCH_NR_STATS] = {};
+    u64 *percpu, nr_groups;
+    u32 idx;
+    int cpu;
+
+    percpu = calloc(nr_possible_cpus, sizeof(*percpu));
+    if (!percpu)
+        return;
+
+    for (idx = 0; idx < CLUTCH_NR_STATS; idx++) {
+        if (bpf_map__lookup_elem(skel->maps.clutch_stats_map, &idx, sizeof(idx),
+                                 percpu, sizeof(*percpu) * nr_possible_cpus, 0))
+            continue;
+
+        for (cpu = 0; cpu < nr_possible_cpus; cpu++)
+            totals[idx] += percpu[cpu];
+    }
+
+    free(percpu);
+
+    printf("stats:");
+    for (idx = 0; idx < CLUTCH_NR_STATS; idx++)
+        printf(" %s=%llu", stat_names[idx], (unsigned long long)totals[idx]);
+    if (totals[CLUTCH_STAT_DISPATCH_SAMPLES])
+        printf(" dispatch_avg_ns=%.1f",
+               (double)totals[CLUTCH_STAT_DISPATCH_NS] /
+               totals[CLUTCH_STAT_DISPATCH_SAMPLES]);
+    nr_groups = totals[CLUTCH_STAT_GROUP_CREATE] > totals[CLUTCH_STAT_GROUP_EVICT] ?
+                totals[CLUTCH_STAT_GROUP_CREATE] - totals[CLUTCH_STAT_GROUP_EVICT] : 0;
+    printf(" groups=%llu/%d\n", (unsigned long long)nr_groups, MAX_GROUPS);
+    if (nr_groups * 100 >= (u64)MAX_GROUPS * GROUP_OCCUPANCY_WARN_PCT ||
+        totals[CLUTCH_STAT_GROUP_FULL])
+        fprintf(stderr, "warning: group_ctx_map at %llu/%d entries, %llu enqueues fell back "
+                "to the global DSQ\n", (unsigned long long)nr_groups, MAX_GROUPS,
+                (unsigned long long)totals[CLUTCH_STAT_GROUP_FULL]);
+    print_bucket_stats(skel, nr_possible_cpus);
+    fflush(stdout);
+}
+
 int main(int argc, char **argv)
 {
     SKEL_TYPE *skel;
     struct cluster_topology topo;
-    struct bucket_config bucket_cfg;
+    struct loader_config cfg;
+    struct bucket_config *bucket_cfg = &cfg.buckets;
+    u32 elapsed_s = 0;
     int err;
     int nr_possible_cpus;
 
     signal(SIGINT, sig_handler);
     signal(SIGTERM, sig_handler);
 
-    err = parse_bucket_config(argc, argv, &bucket_cfg);
+    err = parse_loader_config(argc, argv, &cfg);
     if (err) {
         if (err > 0)
             return 0;
@@ -361,22 +865,47 @@ int main(int argc, char **argv)
         skel->rodata->nr_cpu_ids = (u32)nr_possible_cpus;
         skel->rodata->cpus_per_cluster =
             topo.ready && topo.nr_clusters ? (u32)nr_possible_cpus / topo.nr_clusters : 4;
-        skel->rodata->nr_clutch_buckets = bucket_cfg.nr_buckets;
+        skel->rodata->nr_clutch_buckets = bucket_cfg->nr_buckets;
         skel->rodata->cpu_cluster_map_ready = topo.ready ? 1 : 0;
+        skel->rodata->dispatch_task_lookup = cfg.task_lookup;
+        skel->rodata->dispatch_bench = cfg.bench_dispatch;
+        skel->rodata->dispatch_batch = cfg.dispatch_batch;
+        skel->rodata->clutch_engine = cfg.engine;
+        skel->rodata->steal_imbalance = cfg.steal_imbalance;
+        skel->rodata->steal_migration_cost_ns = cfg.steal_migration_cost_ns;
+        skel->rodata->clutch_group_by = cfg.group_by;
+        skel->rodata->preempt_disabled = cfg.no_preempt;
+        skel->rodata->clutch_eevdf = cfg.eevdf;
 
         for (cpu = 0; cpu < (u32)nr_possible_cpus && cpu < MAX_CPUS; cpu++)
             skel->rodata->cpu_cluster_map[cpu] = topo.cpu_to_cluster[cpu];
 
         for (cpu = 0; cpu < MAX_CLUTCH_BUCKETS; cpu++)
-            skel->rodata->clutch_bucket_ddl_ns[cpu] = bucket_cfg.ddl_ns[cpu];
+            skel->rodata->clutch_bucket_ddl_ns[cpu] = bucket_cfg->ddl_ns[cpu];
+        for (cpu = 0; cpu < MAX_CLUTCH_BUCKETS; cpu++)
+            skel->rodata->clutch_bucket_warp_ns[cpu] = bucket_cfg->warp_ns[cpu];
+        for (cpu = 0; cpu < MAX_CLUTCH_BUCKETS; cpu++)
+            skel->rodata->clutch_bucket_slice_ns[cpu] = bucket_cfg->slice_ns[cpu];
+        skel->rodata->clutch_slice_min_ns = bucket_cfg->slice_min_ns;
+        skel->rodata->clutch_slice_max_ns = bucket_cfg->slice_max_ns;
     }
 
+    if (skel->struct_ops.clutch_ops &&
+        cfg.dispatch_batch > SCX_DFL_DISPATCH_MAX_BATCH)
+        skel->struct_ops.clutch_ops->dispatch_max_batch = cfg.dispatch_batch;
+
     err = SKEL_LOAD(skel);
     if (err) {
         fprintf(stderr, "Failed to load and verify BPF skeleton\n");
         goto cleanup;
     }
 
+    err = apply_qos_overrides(skel, &cfg);
+    if (err) {
+        fprintf(stderr, "Failed to install QoS overrides: %d\n", err);
+        goto cleanup;
+    }
+
     if (skel->struct_ops.clutch_ops) {
         skel->struct_ops.clutch_ops->timeout_ms = 5000;
     }
@@ -392,18 +921,48 @@ int main(int argc, char **argv)
         print_cluster_topology(&topo, nr_possible_cpus);
     else
         printf("  - cluster topology: sysfs unavailable, fallback to fixed-width mapping\n");
-    printf("  - clutch buckets: %u\n", bucket_cfg.nr_buckets);
+    printf("  - engine: %s\n", cfg.engine == CLUTCH_ENGINE_DSQ ? "dsq" : "rbtree");
+    printf("  - clutch buckets: %u\n", bucket_cfg->nr_buckets);
+    printf("  - group by: %s\n", group_by_names[cfg.group_by]);
     printf("  - bucket deadlines (ns):");
-    for (err = 0; err < (int)bucket_cfg.nr_buckets; err++)
-        printf(" %llu", (unsigned long long)bucket_cfg.ddl_ns[err]);
+    for (err = 0; err < (int)bucket_cfg->nr_buckets; err++)
+        printf(" %llu", (unsigned long long)bucket_cfg->ddl_ns[err]);
     printf("\n");
+    printf("  - bucket warp budgets (ns):");
+    for (err = 0; err < (int)bucket_cfg->nr_buckets; err++)
+        printf(" %llu", (unsigned long long)bucket_cfg->warp_ns[err]);
+    printf("\n");
+    printf("  - bucket slices (ns):");
+    for (err = 0; err < (int)bucket_cfg->nr_buckets; err++)
+        printf(" %llu", (unsigned long long)bucket_cfg->slice_ns[err]);
+    printf(", scaled within [%llu, %llu]\n", (unsigned long long)bucket_cfg->slice_min_ns,
+           (unsigned long long)bucket_cfg->slice_max_ns);
+    printf("  - dispatch task lookup: %s%s\n",
+           cfg.task_lookup == CLUTCH_TASK_LOOKUP_PID ? "pid" : "kptr",
+           cfg.bench_dispatch ? " (latency benchmark on)" : "");
+    printf("  - dispatch batch: %u\n", cfg.dispatch_batch);
+    printf("  - enqueue preemption: %s\n", cfg.no_preempt ? "off" : "on");
+    printf("  - pick policy: %s\n", cfg.eevdf ? "eevdf" : "min-vruntime");
+    printf("  - qos overrides: %u tgid, %u cgroup\n", cfg.nr_qos_tgid, cfg.nr_qos_cgroup);
+    if (cfg.steal_imbalance)
+        printf("  - work stealing: imbalance %u, migration cost %lluns\n",
+               cfg.steal_imbalance, (unsigned long long)cfg.steal_migration_cost_ns);
+    else
+        printf("  - work stealing: off\n");
     printf("  - Watchdog: 5000ms\n");
     printf("Press Ctrl+C to stop and detach.\n");
 
     while (!exiting) {
         sleep(1);
+
+        if (cfg.stats_interval_s && ++elapsed_s >= cfg.stats_interval_s) {
+            print_stats(skel, nr_possible_cpus);
+            elapsed_s = 0;
+        }
     }
 
+    print_stats(skel, nr_possible_cpus);
+
 cleanup:
     SKEL_DESTROY(skel);
     return err < 0 ? -err : 0;